@@ -39,6 +39,12 @@
 #include <linux/usb.h>
 #include <linux/version.h>
 #include <linux/kfifo.h>
+#include <linux/completion.h>
+#include <linux/uio.h>
+#include <linux/dma-mapping.h>
+#include <linux/usb/hcd.h>
+#include <linux/pm_runtime.h>
+#include <linux/workqueue.h>
 
 #define DRIVER_AUTHOR "WCH"
 #define DRIVER_DESC \
@@ -50,7 +56,6 @@
 #define CH347_PACKET_LENGTH 512
 #define MAX_BUFFER_LENGTH 0x1000
 #define MAX_SLAVE_LENGTH 0x100000
-#define MAX_TRANSFER 1024
 #define CH346_KFIFO_LENGTH KMALLOC_MAX_SIZE
 
 #define VENDOR_WRITE_TYPE 0x40
@@ -65,13 +70,29 @@
 #define CH34x_PARA_CMD_W1 0xA7 /* write data1 to parport */
 
 #define CH34x_EPP_IO_MAX (CH341_PACKET_LENGTH - 1)
+
+#define CH341_CMD_UIO_STREAM 0xAB
+#define CH341_UIO_STM_IN 0x00 /* read D7-D0 */
+#define CH341_UIO_STM_DIR 0x40 /* set direction of D5-D0 */
+#define CH341_UIO_STM_OUT 0x80 /* set output of D5-D0 */
+#define CH341_UIO_STM_US 0xC0 /* delay in usecs */
+#define CH341_UIO_STM_END 0x20
+#define CH341_UIO_PINS 0x3F
+#define CH341_UIO_US_MAX 0x3F
 #define CH341_EPP_IO_MAX 0xFF
 
 #define CH34x_DEBUG_READ 0x95
 #define CH34x_DEBUG_WRITE 0x9A
+#define USB20_CMD_HEADER 3
 #define USB20_CMD_SPI_BLCK_RD 0xC3
 #define CH34x_CMD_MODE 0xC2
+#define USB20_CMD_JTAG_BIT_OP 0xD1
+#define USB20_CMD_JTAG_BIT_OP_RD 0xD2
+#define USB20_CMD_JTAG_DATA_SHIFT 0xD3
+#define USB20_CMD_JTAG_DATA_SHIFT_RD 0xD4
 #define USB20_CMD_SLAVE_INIT 0xC5
+#define USB20_CMD_INFO_RD 0xCA
+#define CH347_INFO_CHIP 0x00
 
 /* ioctl commands for interaction between driver and application */
 #define IOCTL_MAGIC 'W'
@@ -85,6 +106,7 @@
 #define CH34x_FUNCTION_WRITE_MODE _IOW(IOCTL_MAGIC, 0x92, u16)
 #define CH34x_SET_TIMEOUT _IOW(IOCTL_MAGIC, 0x93, u16)
 #define CH34x_SET_MODE _IOW(IOCTL_MAGIC, 0x94, u16)
+#define CH34x_SET_BUSY_POLL _IOW(IOCTL_MAGIC, 0x95, u16)
 
 #define CH34x_PIPE_DATA_READ _IOWR(IOCTL_MAGIC, 0xb0, u16)
 #define CH34x_PIPE_DATA_WRITE _IOWR(IOCTL_MAGIC, 0xb1, u16)
@@ -96,11 +118,79 @@
 #define CH34x_RESET_SLAVE_FIFO _IOW(IOCTL_MAGIC, 0xb7, u16)
 #define CH34x_READ_SLAVE_FIFO _IOR(IOCTL_MAGIC, 0xb8, u16)
 #define CH34x_INIT_SLAVE _IOW(IOCTL_MAGIC, 0xb9, u16)
+#define CH34x_SPI_BLOCK_READ _IOWR(IOCTL_MAGIC, 0xba, u16)
+#define CH34x_JTAG_SHIFT _IOWR(IOCTL_MAGIC, 0xbb, u16)
+#define CH34x_TXRING_SETUP _IOW(IOCTL_MAGIC, 0xbc, u16)
+#define CH34x_TXRING_DOORBELL _IOWR(IOCTL_MAGIC, 0xbd, u16)
+#define CH34x_PIPE_READ_FRAMES _IOWR(IOCTL_MAGIC, 0xbe, u16)
+#define CH34x_PIPE_LANE_XFER _IOWR(IOCTL_MAGIC, 0xbf, u16)
 
 #define CH34x_START_IRQ_TASK _IOW(IOCTL_MAGIC, 0xc0, u16)
 #define CH34x_STOP_IRQ_TASK _IOW(IOCTL_MAGIC, 0xc1, u16)
+#define CH34x_QUERY_RX_GAP _IOR(IOCTL_MAGIC, 0xc2, u16)
+#define CH34x_GET_CHIP_INFO _IOR(IOCTL_MAGIC, 0xc3, u16)
+#define CH34x_ACQ_START _IOW(IOCTL_MAGIC, 0xc4, u16)
+#define CH34x_ACQ_STOP _IOW(IOCTL_MAGIC, 0xc5, u16)
+#define CH34x_ACQ_STATUS _IOR(IOCTL_MAGIC, 0xc6, u16)
+#define CH34x_ACQ_ARM_GPIO _IOW(IOCTL_MAGIC, 0xc7, u16)
+#define CH34x_UIO_SEQUENCE _IOWR(IOCTL_MAGIC, 0xc8, u16)
+#define CH34x_EPP_SCRIPT _IOWR(IOCTL_MAGIC, 0xc9, u16)
+#define CH34x_MEM_STREAM_START _IOW(IOCTL_MAGIC, 0xca, u16)
+#define CH34x_MEM_STREAM_STOP _IOW(IOCTL_MAGIC, 0xcb, u16)
 
 #define DEFAULT_TIMEOUT 1000
+#define CH34X_BUSY_POLL_MAX 10000 /* usecs */
+
+/* flags of CH34x_SPI_BLOCK_READ */
+#define CH34x_BLKRD_FILL_BYTE 0x01 /* 16-bit spi, one fill byte after header */
+
+#define CH34X_BLKRD_URBS 8
+#define CH34X_EPP_URBS 8
+#define CH34X_EPP_READ_MAX 0x10000
+#define CH34X_DRAIN_TIMEOUT 50 /* msecs of silence which ends a drain */
+#define CH34X_UIO_STEPS_MAX 0x1000
+#define CH34X_EPP_SCRIPT_OPS 0x400
+
+/* rx fifo of the chips without a slave fifo, for acquisition and streams */
+#define CH34X_RX_FIFO_LENGTH 0x100000
+#define CH34X_BLKRD_MAX_LENGTH 0x10000000
+
+/* in urbs spanning many packets of a response stream */
+#define CH34X_AGG_URB_SIZE 0x4000
+#define CH34X_AGG_URBS 4
+#define CH34X_AGG_MAX_LENGTH 0x100000
+#define CH34x_FRAMES_FILL_BYTE 0x01
+
+/* long jobs let queued short commands in every CH34X_LANE_CHUNK bytes */
+#define CH34X_LANE_CHUNK 0x10000
+
+/* flags of CH34x_JTAG_SHIFT */
+#define CH34x_JTAG_ENTER_DR 0x01 /* Run-Test/Idle -> Shift-DR first */
+#define CH34x_JTAG_ENTER_IR 0x02 /* Run-Test/Idle -> Shift-IR first */
+#define CH34x_JTAG_EXIT_IDLE 0x04 /* last bit -> Exit1 -> Run-Test/Idle */
+#define CH34x_JTAG_READ 0x08 /* return TDO bits */
+#define CH34x_JTAG_TRST_LOW 0x10 /* drive TRST low while shifting */
+
+#define JTAG_TDI_H 0x10
+#define JTAG_TDI_L 0x00
+#define JTAG_TMS_H 0x02
+#define JTAG_TMS_L 0x00
+#define JTAG_TCK_H 0x01
+#define JTAG_TCK_L 0x00
+#define JTAG_TRST_H 0x20
+
+#define CH34X_JTAG_PKT_MAX 510 /* payload of one shift packet */
+#define CH34X_JTAG_BATCH 4096 /* TDO buffer size of the chip */
+#define CH34X_JTAG_OUT_URBS 4
+#define CH34X_JTAG_MAX_BITS 0x8000000
+#define CH347T_JTAG_PID 0x55dd /* CH347T mode 3, JTAG+UART */
+
+#define CH34X_TXRING_SLOTS_MAX 64
+#define CH34X_TXRING_MAX_LENGTH 0x400000
+
+#define CH34X_ACQ_PERIOD_MIN 125 /* usecs, one high speed microframe */
+#define CH34X_ACQ_PKT_MAX 4096
+#define CH34X_ACQ_TIMER (-1) /* trigger of CH34x_ACQ_START */
 
 /* Define these values to match your devices */
 
@@ -128,10 +218,116 @@ typedef enum _CHIP_TYPE {
 } CHIP_TYPE;
 
 #define WRITES_IN_FLIGHT 8
+#define CH34X_TX_URB_SIZE 0x10000
+/* completion irq on every 4th urb of a burst, must not exceed the window */
+#define CH34X_TX_COALESCE 4
 #define CH347_MPSI_GPIOS 8
 
 #define CH34X_NR 16
 
+#define CH34X_CHIP_INFO_VERSION 1
+
+/*
+ * Returned by CH34x_GET_CHIP_INFO, read once at probe. New fields are only
+ * added at the end, @size tells how much of it the caller got.
+ */
+struct ch34x_chip_info {
+	u32 size; /* in: size of the user buffer, out: bytes filled */
+	u32 version; /* CH34X_CHIP_INFO_VERSION */
+	u16 vid;
+	u16 pid;
+	u8 chiptype; /* CHIP_TYPE */
+	u8 chipmode; /* work mode of ch346c */
+	u8 speed; /* enum usb_device_speed */
+	u8 ifnum; /* interface number */
+	u16 chipver; /* vendor version of ch341 */
+	u16 fwver; /* firmware version of ch347/ch339 */
+	u16 bulk_in_size;
+	u16 bulk_out_size;
+	u16 intr_in_size;
+	u16 cmd_data_max; /* largest command payload in one packet */
+};
+
+/*
+ * Record of the acquisition stream in the rx fifo, followed by @len
+ * response bytes. @seq numbers the timer ticks or gpio interrupts, a gap
+ * means triggers were skipped while the previous transaction was still on
+ * the bus.
+ */
+struct ch34x_acq_rec {
+	u64 stamp_ns; /* ktime_get() when the command was submitted */
+	u32 seq;
+	u32 len;
+};
+
+/* acquisition, one prebuilt transaction per timer tick or gpio interrupt */
+struct ch34x_acq {
+	int trigger; /* gpio index or CH34X_ACQ_TIMER */
+	struct hrtimer timer;
+	ktime_t period;
+	struct urb *out_urb;
+	struct urb *in_urb;
+	u8 *obuf;
+	u8 *ibuf;
+	u32 ticks;
+	u32 seq; /* tick of the transaction in flight */
+	ktime_t stamp;
+	atomic_t pending; /* urbs of the transaction in flight */
+	u32 overruns; /* ticks skipped, under read_lock */
+	u32 dropped; /* records which did not fit the fifo, under read_lock */
+	bool running;
+};
+
+/*
+ * One step of CH34x_UIO_SEQUENCE on the ch341 parallel pins: drive D5-D0
+ * with @dir and @out, wait @delay_us, then sample D7-D0 if asked to.
+ */
+struct ch34x_uio_step {
+	u8 dir; /* D5-D0, set bits are outputs */
+	u8 out;
+	u8 delay_us;
+	u8 flags; /* CH34x_UIO_SAMPLE */
+};
+
+#define CH34x_UIO_SAMPLE 0x01
+
+/* one cycle of CH34x_EPP_SCRIPT, writes take @len bytes of the data */
+struct ch34x_epp_op {
+	u8 op;
+	u8 reserved;
+	u16 len;
+};
+
+#define CH34x_EPP_WRITE_DATA 0x00
+#define CH34x_EPP_WRITE_ADDR 0x01
+#define CH34x_EPP_READ_DATA 0x02
+#define CH34x_EPP_READ_ADDR 0x03
+
+/*
+ * Continuous ch341 EPP/MEM read into the rx fifo. Every slot is a read
+ * command with the in urb for its answer, a completed slot goes straight
+ * back to the chip unless the fifo has no room for it.
+ */
+struct ch34x_mem_stream {
+	struct urb *in_urbs[CH34X_EPP_URBS];
+	struct urb *cmd_urbs[CH34X_EPP_URBS];
+	u8 *bufs[CH34X_EPP_URBS];
+	u8 *cmd; /* the read command of every slot */
+	u32 chunk;
+	unsigned long parked; /* slots waiting for room, under read_lock */
+	bool running;
+};
+
+/* endpoints waiting for ch34x_halt_work, bits of ch34x_pis.halted */
+#define CH34X_HALT_IN 0
+#define CH34X_HALT_OUT 1
+#define CH34X_HALT_RX 2
+
+static int autosuspend_delay = -1;
+module_param(autosuspend_delay, int, 0444);
+MODULE_PARM_DESC(autosuspend_delay,
+		 "Autosuspend delay in ms, negative keeps the usbcore default");
+
 struct ch34x_rb {
 	int size;
 	unsigned char *base;
@@ -156,10 +352,10 @@ struct ch34x_pis {
 		interrupt_in_buffer; /*the buffer of rec data (interface)*/
 	struct urb *interrupt_in_urb;
 
-	unsigned char *bulk_in_buffer; /*the buffer of rec data (bulk)*/
 	struct urb *read_urb; /*the urb of bulk_in*/
 	u8 bulk_in_endpointAddr; /*bulk input endpoint*/
 	u8 bulk_out_endpointAddr; /*bulk output endpoint*/
+	size_t bulk_in_size; /*max packet size of bulk_in*/
 	unsigned char *bulk_out_buffer;
 
 	int readsize;
@@ -174,32 +370,237 @@ struct ch34x_pis {
 	struct kfifo rfifo;
 	bool buffered_mode;
 	spinlock_t read_lock;
+	struct mutex rfifo_mutex; /* serialize readers of the rx fifo */
+	u64 rx_bytes; /* bytes put into rfifo, under read_lock */
+	u64 rx_gap; /* rx_bytes when the upload was last rearmed */
+	u32 halts; /* recovered stalls, under read_lock */
+
+	unsigned long halted;
+	struct work_struct halt_work;
 
 	bool irq_enable;
 
+	struct ch34x_acq acq;
+	struct ch34x_mem_stream mem;
+
+	/*
+	 * settings of the session holding the device, loaded under
+	 * sched_lock when it takes its turn and only read by that session,
+	 * never by urb completion handlers
+	 */
 	u8 para_rmode;
 	u8 para_wmode;
 	int readtimeout;
 	int writetimeout;
 
+	spinlock_t sched_lock;
+	struct list_head sched_queue; /* sessions waiting for the device */
+	struct ch34x_file *sched_owner; /* session holding the device */
+	wait_queue_head_t sched_wait;
+	/* session running buffered upload, under sched_lock */
+	struct ch34x_file *fifo_owner;
+
+	int sessions; /* open files, under sched_lock */
+
 	struct mutex io_mutex; /* synchronize I/O with disconnect */
 	CHIP_TYPE chiptype;
 	u16 chipver;
 	u8 chipmode;
+	struct ch34x_chip_info info;
 	int errors;
 	spinlock_t err_lock;
 	struct kref kref;
 
 	struct fasync_struct *fasync;
+
+	struct ch34x_rb tx_cache[WRITES_IN_FLIGHT]; /* recycled tx buffers */
+	int tx_cached;
+	spinlock_t tx_lock;
+	u64 tx_urbs;
+	u64 tx_irqs; /* urbs which asked for a completion interrupt */
+	u64 tx_bytes;
+	u64 tx_callback_ns;
+
+	spinlock_t lane_lock;
+	bool lane_open; /* a long job takes short commands in between */
+	struct list_head lane_queue;
+};
+
+/* transmit ring shared with user space, slots are filled in place */
+struct ch34x_txring {
+	struct ch34x_pis *ch34x_dev;
+	u8 *base;
+	dma_addr_t dma;
+	size_t size;
+	u32 slot_size;
+	u32 slot_count;
+	u32 head; /* slots submitted, protected by ring_mutex */
+	u32 tail; /* slots completed, protected by lock */
+	atomic_t mapped;
+	struct urb *urbs[CH34X_TXRING_SLOTS_MAX];
+	struct usb_anchor submitted;
+	wait_queue_head_t wait;
+	spinlock_t lock;
+};
+
+/* per-open state of the device node */
+struct ch34x_file {
+	struct ch34x_pis *ch34x_dev;
+	u32 busy_poll; /* usecs to spin for a response before sleeping */
+	struct ch34x_txring *txring;
+	struct mutex ring_mutex; /* protects txring */
+	u8 para_rmode;
+	u8 para_wmode;
+	int readtimeout;
+	int writetimeout;
+	struct list_head sched; /* entry in sched_queue, under sched_lock */
+	int sched_waiters; /* threads of this session waiting for a turn */
 };
 
 static struct usb_driver ch34x_pis_driver;
 static void ch34x_delete(struct kref *kref);
+static void ch34x_stop_submitted(struct ch34x_pis *ch34x_dev);
+static void ch34x_stop_streams(struct ch34x_pis *ch34x_dev);
 static void stop_data_traffic(struct ch34x_pis *ch34x_dev);
 static int ch34x_submit_read_urbs(struct ch34x_pis *ch34x_dev,
 				  gfp_t mem_flags);
 static void ch34x_usb_free_device(struct ch34x_pis *ch34x_dev);
 
+/* stalls are cleared from process context, see ch34x_halt_work */
+static void ch34x_halt_schedule(struct ch34x_pis *ch34x_dev, int ep)
+{
+	set_bit(ep, &ch34x_dev->halted);
+	schedule_work(&ch34x_dev->halt_work);
+}
+
+/*
+ * Take the device for @cfile if no session holds it and @cfile is next in
+ * line, and load its timeouts and parallel modes for the I/O paths. A
+ * session with more threads waiting goes back to the tail, so the
+ * sessions take turns.
+ */
+static bool ch34x_sched_claim(struct ch34x_pis *ch34x_dev,
+			      struct ch34x_file *cfile)
+{
+	bool claimed = false;
+
+	spin_lock(&ch34x_dev->sched_lock);
+	if (!ch34x_dev->sched_owner &&
+	    list_first_entry(&ch34x_dev->sched_queue, struct ch34x_file,
+			     sched) == cfile) {
+		ch34x_dev->sched_owner = cfile;
+		ch34x_dev->readtimeout = cfile->readtimeout;
+		ch34x_dev->writetimeout = cfile->writetimeout;
+		ch34x_dev->para_rmode = cfile->para_rmode;
+		ch34x_dev->para_wmode = cfile->para_wmode;
+		list_del_init(&cfile->sched);
+		if (--cfile->sched_waiters)
+			list_add_tail(&cfile->sched, &ch34x_dev->sched_queue);
+		claimed = true;
+	}
+	spin_unlock(&ch34x_dev->sched_lock);
+
+	return claimed;
+}
+
+static void ch34x_sched_exit(struct ch34x_file *cfile);
+static void ch34x_mem_stop(struct ch34x_pis *ch34x_dev);
+
+/* an acquisition or a MEM stream owns the bulk endpoints while it runs */
+static bool ch34x_stream_active(struct ch34x_pis *ch34x_dev)
+{
+	return ch34x_dev->acq.running || ch34x_dev->mem.running;
+}
+
+/*
+ * Wait for the turn of @cfile. A turn spans one whole read, write or
+ * ioctl: sessions are interleaved between calls, not between the
+ * packets of one call. Only short commands queued with
+ * CH34x_PIPE_LANE_XFER ride along inside the turn of a long job.
+ * Every successful call is paired with ch34x_sched_exit().
+ */
+static int ch34x_sched_enter(struct ch34x_file *cfile)
+{
+	struct ch34x_pis *ch34x_dev = cfile->ch34x_dev;
+	int retval;
+
+	spin_lock(&ch34x_dev->sched_lock);
+	if (!cfile->sched_waiters++)
+		list_add_tail(&cfile->sched, &ch34x_dev->sched_queue);
+	spin_unlock(&ch34x_dev->sched_lock);
+
+	retval = wait_event_interruptible(ch34x_dev->sched_wait,
+					  ch34x_sched_claim(ch34x_dev, cfile));
+	if (retval) {
+		spin_lock(&ch34x_dev->sched_lock);
+		if (!--cfile->sched_waiters)
+			list_del_init(&cfile->sched);
+		spin_unlock(&ch34x_dev->sched_lock);
+		/* we may have been the head of the queue */
+		wake_up_all(&ch34x_dev->sched_wait);
+		return retval;
+	}
+
+	if (ch34x_stream_active(ch34x_dev)) {
+		ch34x_sched_exit(cfile);
+		return -EBUSY;
+	}
+
+	return 0;
+}
+
+static void ch34x_sched_exit(struct ch34x_file *cfile)
+{
+	struct ch34x_pis *ch34x_dev = cfile->ch34x_dev;
+
+	spin_lock(&ch34x_dev->sched_lock);
+	ch34x_dev->sched_owner = NULL;
+	spin_unlock(&ch34x_dev->sched_lock);
+	wake_up_all(&ch34x_dev->sched_wait);
+}
+
+/*
+ * The slave fifo belongs to the session which started buffered upload,
+ * with @strict only that session may read it, not one of a free fifo.
+ */
+static bool ch34x_fifo_owned(struct ch34x_file *cfile, bool strict)
+{
+	struct ch34x_pis *ch34x_dev = cfile->ch34x_dev;
+	bool owned;
+
+	spin_lock(&ch34x_dev->sched_lock);
+	owned = ch34x_dev->fifo_owner == cfile ||
+		(!strict && !ch34x_dev->fifo_owner);
+	spin_unlock(&ch34x_dev->sched_lock);
+
+	return owned;
+}
+
+static int ch34x_fifo_claim(struct ch34x_file *cfile)
+{
+	struct ch34x_pis *ch34x_dev = cfile->ch34x_dev;
+	int retval = 0;
+
+	spin_lock(&ch34x_dev->sched_lock);
+	if (ch34x_dev->fifo_owner && ch34x_dev->fifo_owner != cfile)
+		retval = -EBUSY;
+	else
+		ch34x_dev->fifo_owner = cfile;
+	spin_unlock(&ch34x_dev->sched_lock);
+
+	return retval;
+}
+
+static void ch34x_fifo_release(struct ch34x_file *cfile)
+{
+	struct ch34x_pis *ch34x_dev = cfile->ch34x_dev;
+
+	spin_lock(&ch34x_dev->sched_lock);
+	if (ch34x_dev->fifo_owner == cfile)
+		ch34x_dev->fifo_owner = NULL;
+	spin_unlock(&ch34x_dev->sched_lock);
+}
+
 /* USB control transfer in */
 static int ch34x_control_transfer_in(u8 request, u16 value, u16 index,
 				     struct ch34x_pis *ch34x_dev,
@@ -251,280 +652,677 @@ static int ch34x_parallel_init(unsigned char mode,
 	return retval;
 }
 
+/* largest EPP/MEM read one command asks for */
+static u32 ch34x_epp_read_step(struct ch34x_pis *ch34x_dev)
+{
+	return (ch34x_dev->chipver >= 0x20) ?
+		       (CH341_EPP_IO_MAX -
+			(CH341_EPP_IO_MAX & (CH341_PACKET_LENGTH - 1))) :
+		       CH34x_EPP_IO_MAX;
+}
+
+struct ch34x_blkrd_urb {
+	struct urb *urb;
+	unsigned char *buf;
+	struct completion done;
+};
+
+static void ch34x_blkrd_callback(struct urb *urb)
+{
+	struct ch34x_blkrd_urb *bu = urb->context;
+
+	complete(&bu->done);
+}
+
 /*
- * Read operation for parallel port read in EPP/MEM mode.
+ * Read and drop up to @budget bytes the chip still owes for commands it
+ * has taken, so the next request does not pick up stale responses. Ends
+ * at the first read which gets nothing within CH34X_DRAIN_TIMEOUT.
  */
-static ssize_t ch34x_fops_read(struct file *file, char __user *to_user,
+static void ch34x_drain_in(struct ch34x_pis *ch34x_dev, size_t budget)
+{
+	unsigned int inpipe = usb_rcvbulkpipe(ch34x_dev->udev,
+					      ch34x_dev->bulk_in_endpointAddr);
+	int actual;
+	u8 *buf;
+
+	buf = kmalloc(ch34x_dev->bulk_in_size, GFP_KERNEL);
+	if (!buf)
+		return;
+
+	while (budget) {
+		if (usb_bulk_msg(ch34x_dev->udev, inpipe, buf,
+				 ch34x_dev->bulk_in_size, &actual,
+				 CH34X_DRAIN_TIMEOUT) || !actual)
+			break;
+		budget -= min_t(size_t, budget, actual);
+	}
+	kfree(buf);
+}
+
+/*
+ * Read operation for parallel port read in EPP/MEM mode. The read
+ * commands of all chunks go out in one transfer while CH34X_EPP_URBS in
+ * urbs stay queued, one per chunk, so the chip never waits for a round
+ * trip of the host.
+ */
+static ssize_t ch34x_para_read(struct file *file, char __user *to_user,
 			       size_t count, loff_t *file_pos)
 {
-	struct ch34x_pis *ch34x_dev;
-	unsigned char buffer[4], *ibuf;
-	int retval, i;
-	unsigned long bytes_per_read, times;
-	int actual_len;
-	unsigned long bytes_to_read, totallen = 0;
-
-	ibuf = kmalloc(2, GFP_KERNEL);
-	if (!ibuf)
-		return -ENOMEM;
+	struct ch34x_pis *ch34x_dev =
+		((struct ch34x_file *)file->private_data)->ch34x_dev;
+	struct ch34x_blkrd_urb bu[CH34X_EPP_URBS] = {};
+	struct ch34x_blkrd_urb cmd = {};
+	unsigned long bytes_per_read, timeout;
+	unsigned int inpipe;
+	size_t totallen = 0;
+	u32 times, len;
+	long timeleft;
+	int retval;
+	int i, cur;
 
-	ch34x_dev = (struct ch34x_pis *)file->private_data;
-	if (count == 0 || count > MAX_BUFFER_LENGTH) {
+	if (count == 0 || count > CH34X_EPP_READ_MAX)
 		return -EINVAL;
-	}
-	bytes_per_read =
-		(ch34x_dev->chipver >= 0x20) ?
-			(CH341_EPP_IO_MAX -
-			 (CH341_EPP_IO_MAX & (CH341_PACKET_LENGTH - 1))) :
-			CH34x_EPP_IO_MAX;
 
-	times = count / bytes_per_read;
-	ibuf[0] = buffer[0] = buffer[2] = ch34x_dev->para_rmode;
-	buffer[1] = (unsigned char)bytes_per_read;
-	buffer[3] = (unsigned char)(count - times * bytes_per_read);
+	bytes_per_read = ch34x_epp_read_step(ch34x_dev);
+	times = DIV_ROUND_UP(count, bytes_per_read);
+	timeout = ch34x_dev->readtimeout ?
+			  msecs_to_jiffies(ch34x_dev->readtimeout) :
+			  MAX_SCHEDULE_TIMEOUT;
+
+	cmd.urb = usb_alloc_urb(0, GFP_KERNEL);
+	cmd.buf = kmalloc(times * 2, GFP_KERNEL);
+	if (!cmd.urb || !cmd.buf) {
+		retval = -ENOMEM;
+		goto error;
+	}
+	init_completion(&cmd.done);
+	for (i = 0; i < times; i++) {
+		cmd.buf[i * 2] = ch34x_dev->para_rmode;
+		cmd.buf[i * 2 + 1] =
+			min_t(size_t, count - i * bytes_per_read,
+			      bytes_per_read);
+	}
 
-	if (buffer[3])
-		times++;
+	for (i = 0; i < CH34X_EPP_URBS && i < times; i++) {
+		bu[i].urb = usb_alloc_urb(0, GFP_KERNEL);
+		if (!bu[i].urb) {
+			retval = -ENOMEM;
+			goto error;
+		}
+		bu[i].buf = usb_alloc_coherent(ch34x_dev->udev,
+					       bytes_per_read, GFP_KERNEL,
+					       &bu[i].urb->transfer_dma);
+		if (!bu[i].buf) {
+			retval = -ENOMEM;
+			goto error;
+		}
+		init_completion(&bu[i].done);
+	}
 
 	mutex_lock(&ch34x_dev->io_mutex);
 	if (!ch34x_dev->interface) {
-		retval = -ENODEV;
 		mutex_unlock(&ch34x_dev->io_mutex);
-		goto exit;
+		retval = -ENODEV;
+		goto error;
+	}
+	inpipe = usb_rcvbulkpipe(ch34x_dev->udev,
+				 ch34x_dev->bulk_in_endpointAddr);
+
+	/* each chunk is answered in packets of its own, one urb per chunk */
+	for (i = 0; i < CH34X_EPP_URBS && i < times; i++) {
+		usb_fill_bulk_urb(bu[i].urb, ch34x_dev->udev, inpipe,
+				  bu[i].buf, cmd.buf[i * 2 + 1],
+				  ch34x_blkrd_callback, &bu[i]);
+		bu[i].urb->transfer_flags |= URB_NO_TRANSFER_DMA_MAP;
+		retval = usb_submit_urb(bu[i].urb, GFP_KERNEL);
+		if (retval)
+			goto error_kill;
 	}
-	mutex_unlock(&ch34x_dev->io_mutex);
 
-	for (i = 0; i < times; i++) {
-		if ((i + 1) == times && buffer[3]) {
-			ibuf[1] = buffer[3];
-			bytes_to_read = buffer[3];
-		} else {
-			ibuf[1] = buffer[1];
-			bytes_to_read = bytes_per_read;
-		}
+	/*
+	 * Do not wait for the commands, the chip stops taking them while
+	 * its responses are not read.
+	 */
+	usb_fill_bulk_urb(cmd.urb, ch34x_dev->udev,
+			  usb_sndbulkpipe(ch34x_dev->udev,
+					  ch34x_dev->bulk_out_endpointAddr),
+			  cmd.buf, times * 2, ch34x_blkrd_callback, &cmd);
+	retval = usb_submit_urb(cmd.urb, GFP_KERNEL);
+	if (retval)
+		goto error_kill;
 
-		ch34x_dev->bulk_in_buffer = kmalloc(
-			sizeof(unsigned char) * bytes_to_read, GFP_KERNEL);
-		if (ch34x_dev->bulk_in_buffer == NULL) {
-			retval = -ENOMEM;
-			goto exit;
+	/* bulk urbs of one endpoint complete in submission order */
+	for (i = 0; i < times; i++) {
+		cur = i % CH34X_EPP_URBS;
+		timeleft = wait_for_completion_interruptible_timeout(
+			&bu[cur].done, timeout);
+		if (timeleft <= 0) {
+			retval = timeleft ? timeleft : -ETIMEDOUT;
+			goto error_kill;
 		}
-
-		mutex_lock(&ch34x_dev->io_mutex);
-		retval = usb_bulk_msg(
-			ch34x_dev->udev,
-			usb_sndbulkpipe(ch34x_dev->udev,
-					ch34x_dev->bulk_out_endpointAddr),
-			ibuf, 0x02, NULL, ch34x_dev->writetimeout);
+		retval = bu[cur].urb->status;
 		if (retval) {
-			mutex_unlock(&ch34x_dev->io_mutex);
-			goto exit1;
+			if (retval == -EPIPE)
+				ch34x_halt_schedule(ch34x_dev, CH34X_HALT_IN);
+			goto error_kill;
 		}
-		retval = usb_bulk_msg(
-			ch34x_dev->udev,
-			usb_rcvbulkpipe(ch34x_dev->udev,
-					ch34x_dev->bulk_in_endpointAddr),
-			ch34x_dev->bulk_in_buffer, bytes_to_read,
-			&actual_len, ch34x_dev->readtimeout);
-		if (retval) {
-			mutex_unlock(&ch34x_dev->io_mutex);
-			goto exit1;
+
+		len = bu[cur].urb->actual_length;
+		if (copy_to_user(to_user + totallen, bu[cur].buf, len)) {
+			retval = -EFAULT;
+			goto error_kill;
 		}
-		mutex_unlock(&ch34x_dev->io_mutex);
-		retval = copy_to_user(to_user + totallen,
-				      ch34x_dev->bulk_in_buffer,
-				      actual_len);
+		totallen += len;
+
+		if (i + CH34X_EPP_URBS >= times)
+			continue;
+		bu[cur].urb->transfer_buffer_length =
+			cmd.buf[(i + CH34X_EPP_URBS) * 2 + 1];
+		reinit_completion(&bu[cur].done);
+		retval = usb_submit_urb(bu[cur].urb, GFP_KERNEL);
 		if (retval)
-			goto exit1;
-		totallen += actual_len;
+			goto error_kill;
 	}
-exit1:
-	if (ch34x_dev->bulk_in_buffer)
-		kfree(ch34x_dev->bulk_in_buffer);
-exit:
-	if (ibuf)
-		kfree(ibuf);
+
+	/* all responses are in, so the chip has taken every command */
+	if (!wait_for_completion_timeout(&cmd.done, timeout))
+		retval = -ETIMEDOUT;
+	else
+		retval = cmd.urb->status;
+	if (retval == -EPIPE)
+		ch34x_halt_schedule(ch34x_dev, CH34X_HALT_OUT);
+
+error_kill:
+	usb_kill_urb(cmd.urb);
+	for (i = 0; i < CH34X_EPP_URBS; i++)
+		usb_kill_urb(bu[i].urb);
+	/* the chip still answers the read commands it has taken */
+	if (retval && retval != -EPIPE)
+		ch34x_drain_in(ch34x_dev, count - totallen);
+	mutex_unlock(&ch34x_dev->io_mutex);
+error:
+	for (i = 0; i < CH34X_EPP_URBS; i++) {
+		if (bu[i].buf)
+			usb_free_coherent(ch34x_dev->udev, bytes_per_read,
+					  bu[i].buf, bu[i].urb->transfer_dma);
+		usb_free_urb(bu[i].urb);
+	}
+	usb_free_urb(cmd.urb);
+	kfree(cmd.buf);
+
+	/* a timeout or a signal still returns what arrived before it */
+	if ((retval == -ETIMEDOUT || retval == -ERESTARTSYS) && totallen)
+		return totallen;
 	return retval == 0 ? totallen : retval;
 }
 
-static void ch34x_write_bulk_callback(struct urb *urb)
+static ssize_t ch34x_fops_read(struct file *file, char __user *to_user,
+			       size_t count, loff_t *file_pos)
 {
-	struct ch34x_pis *ch34x_dev;
+	struct ch34x_file *cfile = file->private_data;
+	ssize_t retval;
 
-	ch34x_dev = urb->context;
+	retval = ch34x_sched_enter(cfile);
+	if (retval)
+		return retval;
+	retval = ch34x_para_read(file, to_user, count, file_pos);
+	ch34x_sched_exit(cfile);
 
-	/* sync/async unlink faults aren't errors */
-	if (urb->status) {
-		if (!(urb->status == -ENOENT ||
-		      urb->status == -ECONNRESET ||
-		      urb->status == -ESHUTDOWN))
-			dev_err(&ch34x_dev->interface->dev,
-				"%s - nonzero write bulk status received: %d\n",
-				__func__, urb->status);
+	return retval;
+}
 
-		spin_lock(&ch34x_dev->err_lock);
-		ch34x_dev->errors = urb->status;
-		spin_unlock(&ch34x_dev->err_lock);
+/*
+ * Compile @steps into UIO stream commands, each packet on a
+ * CH341_PACKET_LENGTH boundary of @cmd. Direction and output only go out
+ * when they change. @nin gets the samples of every packet, the chip
+ * answers each packet with samples by a packet of its own.
+ */
+static u32 ch34x_uio_compile(const struct ch34x_uio_step *steps, u32 nsteps,
+			     u8 *cmd, u8 *nin, u32 *npkts)
+{
+	u8 op[8];
+	u32 base = 0, plen = 1, pkt = 0;
+	u32 i, n, delay, us;
+	int dir = -1, out = -1;
+
+	cmd[0] = CH341_CMD_UIO_STREAM;
+	nin[0] = 0;
+	for (i = 0; i < nsteps; i++) {
+		n = 0;
+		/* the level first, so an output does not glitch */
+		if (out != (steps[i].out & CH341_UIO_PINS)) {
+			out = steps[i].out & CH341_UIO_PINS;
+			op[n++] = CH341_UIO_STM_OUT | out;
+		}
+		if (dir != (steps[i].dir & CH341_UIO_PINS)) {
+			dir = steps[i].dir & CH341_UIO_PINS;
+			op[n++] = CH341_UIO_STM_DIR | dir;
+		}
+		for (delay = steps[i].delay_us; delay; delay -= us) {
+			us = min_t(u32, delay, CH341_UIO_US_MAX);
+			op[n++] = CH341_UIO_STM_US | us;
+		}
+		if (steps[i].flags & CH34x_UIO_SAMPLE)
+			op[n++] = CH341_UIO_STM_IN;
+
+		/* a step is not split, the packet keeps room for its end */
+		if (plen + n + 1 > CH341_PACKET_LENGTH) {
+			cmd[base + plen] = CH341_UIO_STM_END;
+			base += CH341_PACKET_LENGTH;
+			plen = 1;
+			cmd[base] = CH341_CMD_UIO_STREAM;
+			nin[++pkt] = 0;
+		}
+		memcpy(cmd + base + plen, op, n);
+		plen += n;
+		if (steps[i].flags & CH34x_UIO_SAMPLE)
+			nin[pkt]++;
 	}
+	cmd[base + plen] = CH341_UIO_STM_END;
+	*npkts = pkt + 1;
 
-	/* free up our allocated buffer */
-	usb_free_coherent(urb->dev, urb->transfer_buffer_length,
-			  urb->transfer_buffer, urb->transfer_dma);
-	up(&ch34x_dev->limit_sem);
+	return base + plen + 1;
+}
+
+/* out urbs of a ch341 script, the last completion wakes the caller */
+struct ch34x_script_out {
+	struct completion done;
+	atomic_t pending;
+	int status;
+};
+
+static void ch34x_script_out_callback(struct urb *urb)
+{
+	struct ch34x_script_out *so = urb->context;
+
+	if (urb->status && !so->status)
+		so->status = urb->status;
+	if (atomic_dec_and_test(&so->pending))
+		complete(&so->done);
 }
 
 /*
- * Write operation for parallel port read in EPP/MEM mode.
+ * Send the ch341 commands in @cmd and collect @nrsp responses of @rsp[i]
+ * bytes into @out. @seg holds the end offsets of the out transfers, each
+ * one but the last ends with a short packet. All of them are submitted at
+ * once and the in urbs are queued before them like for EPP reads, so the
+ * chip runs the whole script at its own pace. Returns the bytes read.
  */
-static ssize_t ch34x_fops_write(struct file *file,
-				const char __user *user_buffer,
-				size_t count, loff_t *file_pos)
+static int ch34x_ch341_script(struct ch34x_pis *ch34x_dev, u8 *cmd,
+			      const u32 *seg, u32 nseg, const u32 *rsp,
+			      u32 nrsp, u32 rspmax, u8 __user *out)
 {
-	struct ch34x_pis *ch34x_dev;
-	int retval = 0;
-	char *ibuf;
-	char *buf = NULL;
-	struct urb *urb = NULL;
-	unsigned int i;
-	unsigned int mlen, mnewlen, totallen = 0;
-	int times;
+	struct ch34x_blkrd_urb bu[CH34X_EPP_URBS] = {};
+	struct ch34x_script_out so;
+	struct urb **curbs;
+	unsigned long timeout;
+	unsigned int inpipe, outpipe;
+	u32 total = 0, off = 0, len;
+	long timeleft;
+	int retval = -ENOMEM;
+	int i, cur;
 
-	ch34x_dev = (struct ch34x_pis *)file->private_data;
-	if (count > MAX_TRANSFER || count <= 0) {
-		retval = -EINVAL;
-		goto exit;
-	}
+	timeout = ch34x_dev->readtimeout ?
+			  msecs_to_jiffies(ch34x_dev->readtimeout) :
+			  MAX_SCHEDULE_TIMEOUT;
 
-	/*
-	 * limit the number of URBs in flight to stop a user from using up all
-	 * RAM
-	 */
-	if (down_interruptible(&ch34x_dev->limit_sem)) {
-		retval = -ERESTARTSYS;
-		goto exit;
+	curbs = kcalloc(nseg, sizeof(*curbs), GFP_KERNEL);
+	if (!curbs)
+		return -ENOMEM;
+	for (i = 0; i < nseg; i++) {
+		curbs[i] = usb_alloc_urb(0, GFP_KERNEL);
+		if (!curbs[i])
+			goto error;
 	}
+	init_completion(&so.done);
+	atomic_set(&so.pending, nseg);
+	so.status = 0;
 
-	spin_lock_irq(&ch34x_dev->err_lock);
-	retval = ch34x_dev->errors;
-	if (retval < 0) {
-		ch34x_dev->errors = 0;
-		retval = (retval == -EPIPE) ? retval : -EIO;
+	for (i = 0; i < CH34X_EPP_URBS && i < nrsp; i++) {
+		bu[i].urb = usb_alloc_urb(0, GFP_KERNEL);
+		if (!bu[i].urb)
+			goto error;
+		bu[i].buf = usb_alloc_coherent(ch34x_dev->udev, rspmax,
+					       GFP_KERNEL,
+					       &bu[i].urb->transfer_dma);
+		if (!bu[i].buf)
+			goto error;
+		init_completion(&bu[i].done);
 	}
-	spin_unlock_irq(&ch34x_dev->err_lock);
-	if (retval < 0)
-		goto exit;
 
-	times = count / CH34x_EPP_IO_MAX;
-	mlen = count - times * CH34x_EPP_IO_MAX;
-	mnewlen = times * CH341_PACKET_LENGTH;
-
-	/* create a urb, and a buffer for it, and copy the data to the urb */
-	urb = usb_alloc_urb(0, GFP_KERNEL);
-	if (!urb) {
-		retval = -ENOMEM;
+	mutex_lock(&ch34x_dev->io_mutex);
+	if (!ch34x_dev->interface) {
+		mutex_unlock(&ch34x_dev->io_mutex);
+		retval = -ENODEV;
 		goto error;
 	}
+	inpipe = usb_rcvbulkpipe(ch34x_dev->udev,
+				 ch34x_dev->bulk_in_endpointAddr);
+	outpipe = usb_sndbulkpipe(ch34x_dev->udev,
+				  ch34x_dev->bulk_out_endpointAddr);
+
+	for (i = 0; i < CH34X_EPP_URBS && i < nrsp; i++) {
+		usb_fill_bulk_urb(bu[i].urb, ch34x_dev->udev, inpipe,
+				  bu[i].buf, rsp[i], ch34x_blkrd_callback,
+				  &bu[i]);
+		bu[i].urb->transfer_flags |= URB_NO_TRANSFER_DMA_MAP;
+		retval = usb_submit_urb(bu[i].urb, GFP_KERNEL);
+		if (retval)
+			goto error_kill;
+	}
 
-	buf = (char *)kmalloc(sizeof(unsigned char) * MAX_BUFFER_LENGTH,
-			      GFP_KERNEL);
-	if (!buf) {
-		retval = -ENOMEM;
-		goto error;
+	for (i = 0; i < nseg; i++) {
+		usb_fill_bulk_urb(curbs[i], ch34x_dev->udev, outpipe,
+				  cmd + off, seg[i] - off,
+				  ch34x_script_out_callback, &so);
+		off = seg[i];
+		retval = usb_submit_urb(curbs[i], GFP_KERNEL);
+		if (retval)
+			goto error_kill;
 	}
 
-	for (i = 0; i < mnewlen; i += CH341_PACKET_LENGTH) {
-		buf[i] = ch34x_dev->para_wmode;
-		retval = copy_from_user(buf + i + 1,
-					user_buffer + totallen,
-					CH34x_EPP_IO_MAX);
-		if (retval) {
-			goto error;
+	for (i = 0; i < nrsp; i++) {
+		cur = i % CH34X_EPP_URBS;
+		timeleft = wait_for_completion_interruptible_timeout(
+			&bu[cur].done, timeout);
+		if (timeleft <= 0) {
+			retval = timeleft ? timeleft : -ETIMEDOUT;
+			goto error_kill;
 		}
-		totallen += CH341_PACKET_LENGTH;
-	}
-	if (mlen) {
-		buf[i] = ch34x_dev->para_wmode;
-		retval = copy_from_user(buf + i + 1,
-					user_buffer + totallen, mlen);
+		retval = bu[cur].urb->status;
 		if (retval) {
-			goto error;
+			if (retval == -EPIPE)
+				ch34x_halt_schedule(ch34x_dev, CH34X_HALT_IN);
+			goto error_kill;
 		}
-		mnewlen += mlen + 1;
+
+		len = bu[cur].urb->actual_length;
+		if (copy_to_user(out + total, bu[cur].buf, len)) {
+			retval = -EFAULT;
+			goto error_kill;
+		}
+		total += len;
+
+		if (i + CH34X_EPP_URBS >= nrsp)
+			continue;
+		bu[cur].urb->transfer_buffer_length = rsp[i + CH34X_EPP_URBS];
+		reinit_completion(&bu[cur].done);
+		retval = usb_submit_urb(bu[cur].urb, GFP_KERNEL);
+		if (retval)
+			goto error_kill;
 	}
 
-	ibuf = usb_alloc_coherent(ch34x_dev->udev, mnewlen, GFP_KERNEL,
-				  &urb->transfer_dma);
-	if (!ibuf) {
-		retval = -ENOMEM;
-		goto error;
+	/* all responses are in, so the chip has taken every command */
+	if (!wait_for_completion_timeout(&so.done, timeout))
+		retval = -ETIMEDOUT;
+	else
+		retval = so.status;
+	if (retval == -EPIPE)
+		ch34x_halt_schedule(ch34x_dev, CH34X_HALT_OUT);
+
+error_kill:
+	for (i = 0; i < nseg; i++)
+		usb_kill_urb(curbs[i]);
+	for (i = 0; i < CH34X_EPP_URBS; i++)
+		usb_kill_urb(bu[i].urb);
+	mutex_unlock(&ch34x_dev->io_mutex);
+error:
+	for (i = 0; i < CH34X_EPP_URBS; i++) {
+		if (bu[i].buf)
+			usb_free_coherent(ch34x_dev->udev, rspmax, bu[i].buf,
+					  bu[i].urb->transfer_dma);
+		usb_free_urb(bu[i].urb);
 	}
+	for (i = 0; i < nseg; i++)
+		usb_free_urb(curbs[i]);
+	kfree(curbs);
 
-	memcpy(ibuf, buf, mnewlen);
+	return retval ? retval : total;
+}
 
-	mutex_lock(&ch34x_dev->io_mutex);
-	if (!ch34x_dev->interface) {
-		mutex_unlock(&ch34x_dev->io_mutex);
-		retval = -ENODEV;
-		goto error;
-	}
+/*
+ * Run a sequence of pin states on the ch341 in one bulk transfer and
+ * return the sampled inputs.
+ */
+static int ch34x_uio_sequence(struct ch34x_pis *ch34x_dev,
+			      const void __user *usteps, u8 __user *samples,
+			      u32 nsteps)
+{
+	struct ch34x_uio_step *steps;
+	u32 npkts, cmdlen;
+	u32 *rsp = NULL, nrsp = 0;
+	u8 *nin = NULL, *cmd = NULL;
+	int retval;
+	int i;
 
-	/* initialize the urb properly */
-	usb_fill_bulk_urb(
-		urb, ch34x_dev->udev,
-		usb_sndbulkpipe(ch34x_dev->udev,
-				ch34x_dev->bulk_out_endpointAddr),
-		ibuf, mnewlen, ch34x_write_bulk_callback, ch34x_dev);
-	urb->transfer_flags |= URB_NO_TRANSFER_DMA_MAP;
-	usb_anchor_urb(urb, &ch34x_dev->submitted);
+	if (ch34x_dev->chiptype != CHIP_CH341)
+		return -EOPNOTSUPP;
+	if (nsteps == 0 || nsteps > CH34X_UIO_STEPS_MAX)
+		return -EINVAL;
 
-	/* send the data out the bulk port */
-	retval = usb_submit_urb(urb, GFP_KERNEL);
-	mutex_unlock(&ch34x_dev->io_mutex);
-	if (retval) {
-		dev_err(&ch34x_dev->interface->dev,
-			"%s - failed submitting write urb, error %d\n",
-			__func__, retval);
-		goto error_unanchor;
+	steps = memdup_user(usteps, nsteps * sizeof(*steps));
+	if (IS_ERR(steps))
+		return PTR_ERR(steps);
+
+	/* a step takes at most 8 commands, so one packet each at worst */
+	retval = -ENOMEM;
+	cmd = kzalloc(nsteps * CH341_PACKET_LENGTH, GFP_KERNEL);
+	nin = kmalloc(nsteps, GFP_KERNEL);
+	rsp = kmalloc_array(nsteps, sizeof(u32), GFP_KERNEL);
+	if (!cmd || !nin || !rsp)
+		goto exit;
+
+	cmdlen = ch34x_uio_compile(steps, nsteps, cmd, nin, &npkts);
+	for (i = 0; i < npkts; i++) {
+		if (nin[i])
+			rsp[nrsp++] = nin[i];
 	}
 
-	/*
-	 * release our reference to this urb, the USB core will eventually free
-	 * it entirely
-	 */
-	usb_free_urb(urb);
+	retval = ch34x_ch341_script(ch34x_dev, cmd, &cmdlen, 1, rsp, nrsp,
+				    CH341_PACKET_LENGTH, samples);
 
-	if (buf)
-		kfree(buf);
+exit:
+	kfree(rsp);
+	kfree(nin);
+	kfree(cmd);
+	kfree(steps);
+	return retval;
+}
 
-	return count;
+/*
+ * Run a list of EPP/MEM address and data cycles as one script. Writes
+ * start a packet of their own and fill it, reads are packed two bytes
+ * per command. A packet left short ends an out transfer, the chip takes
+ * the rest of a write packet as data.
+ */
+static int ch34x_epp_script(struct ch34x_pis *ch34x_dev,
+			    const void __user *uops, u32 nops,
+			    const u8 __user *wdata, u32 wlen,
+			    u8 __user *rdata)
+{
+	struct ch34x_epp_op *ops;
+	u32 step = ch34x_epp_read_step(ch34x_dev);
+	u32 size = 0, nchunks = 0, wtotal = 0, rtotal = 0;
+	u32 pos = 0, pkt = 0, nseg = 0, nrsp = 0, woff = 0;
+	u32 *seg = NULL, *rsp = NULL;
+	u8 *cmd = NULL, *wbuf = NULL;
+	bool wpkt = false;
+	u32 i, off, len;
+	int retval;
 
-error_unanchor:
-	usb_unanchor_urb(urb);
-error:
-	if (buf)
-		kfree(buf);
-	if (urb) {
-		usb_free_coherent(ch34x_dev->udev, count, ibuf,
-				  urb->transfer_dma);
-		usb_free_urb(urb);
+	if (ch34x_dev->chiptype != CHIP_CH341)
+		return -EOPNOTSUPP;
+	if (nops == 0 || nops > CH34X_EPP_SCRIPT_OPS ||
+	    wlen > CH34X_EPP_READ_MAX)
+		return -EINVAL;
+
+	ops = memdup_user(uops, nops * sizeof(*ops));
+	if (IS_ERR(ops))
+		return PTR_ERR(ops);
+
+	/* size the buffers, a chunk may leave a short packet behind */
+	retval = -EINVAL;
+	for (i = 0; i < nops; i++) {
+		len = ops[i].len;
+		if (!len)
+			goto exit;
+		switch (ops[i].op) {
+		case CH34x_EPP_WRITE_DATA:
+		case CH34x_EPP_WRITE_ADDR:
+			wtotal += len;
+			nchunks += DIV_ROUND_UP(len, CH34x_EPP_IO_MAX);
+			size += DIV_ROUND_UP(len, CH34x_EPP_IO_MAX) *
+				CH341_PACKET_LENGTH;
+			break;
+		case CH34x_EPP_READ_DATA:
+		case CH34x_EPP_READ_ADDR:
+			rtotal += len;
+			nchunks += DIV_ROUND_UP(len, step);
+			size += DIV_ROUND_UP(len, step) * 2 +
+				CH341_PACKET_LENGTH;
+			break;
+		default:
+			goto exit;
+		}
 	}
-	up(&ch34x_dev->limit_sem);
+	if (wtotal != wlen || rtotal > CH34X_EPP_READ_MAX)
+		goto exit;
+
+	retval = -ENOMEM;
+	cmd = kmalloc(size, GFP_KERNEL);
+	seg = kmalloc_array(nchunks + 1, sizeof(u32), GFP_KERNEL);
+	rsp = kmalloc_array(nchunks, sizeof(u32), GFP_KERNEL);
+	if (!cmd || !seg || !rsp)
+		goto exit;
+
+	if (wlen) {
+		wbuf = memdup_user(wdata, wlen);
+		if (IS_ERR(wbuf)) {
+			retval = PTR_ERR(wbuf);
+			wbuf = NULL;
+			goto exit;
+		}
+	}
+
+	for (i = 0; i < nops; i++) {
+		for (off = 0; off < ops[i].len; off += len) {
+			switch (ops[i].op) {
+			case CH34x_EPP_WRITE_DATA:
+			case CH34x_EPP_WRITE_ADDR:
+				len = min_t(u32, ops[i].len - off,
+					    CH34x_EPP_IO_MAX);
+				if (pkt)
+					seg[nseg++] = pos;
+				cmd[pos] = ops[i].op == CH34x_EPP_WRITE_DATA ?
+						   CH34x_PARA_CMD_W0 :
+						   CH34x_PARA_CMD_W1;
+				memcpy(cmd + pos + 1, wbuf + woff, len);
+				woff += len;
+				pos += len + 1;
+				pkt = len + 1;
+				wpkt = true;
+				break;
+			default:
+				len = min_t(u32, ops[i].len - off, step);
+				if (pkt && wpkt)
+					seg[nseg++] = pos;
+				if (wpkt)
+					pkt = 0;
+				cmd[pos] = ops[i].op == CH34x_EPP_READ_DATA ?
+						   CH34x_PARA_CMD_R0 :
+						   CH34x_PARA_CMD_R1;
+				cmd[pos + 1] = len;
+				pos += 2;
+				pkt += 2;
+				wpkt = false;
+				rsp[nrsp++] = len;
+				break;
+			}
+			/* a full packet goes on in the same transfer */
+			if (pkt == CH341_PACKET_LENGTH)
+				pkt = 0;
+		}
+	}
+	seg[nseg++] = pos;
+
+	retval = ch34x_ch341_script(ch34x_dev, cmd, seg, nseg, rsp, nrsp,
+				    step, rdata);
+
 exit:
+	kfree(wbuf);
+	kfree(rsp);
+	kfree(seg);
+	kfree(cmd);
+	kfree(ops);
 	return retval;
 }
 
+static void ch34x_write_bulk_status(struct ch34x_pis *ch34x_dev,
+				    struct urb *urb)
+{
+	/* sync/async unlink faults aren't errors */
+	if (urb->status) {
+		if (!(urb->status == -ENOENT ||
+		      urb->status == -ECONNRESET ||
+		      urb->status == -ESHUTDOWN))
+			dev_err(&ch34x_dev->interface->dev,
+				"%s - nonzero write bulk status received: %d\n",
+				__func__, urb->status);
+
+		spin_lock(&ch34x_dev->err_lock);
+		ch34x_dev->errors = urb->status;
+		spin_unlock(&ch34x_dev->err_lock);
+		if (urb->status == -EPIPE)
+			ch34x_halt_schedule(ch34x_dev, CH34X_HALT_OUT);
+	}
+}
+
+/* account a completed write urb, @start is the entry time of its callback */
+static void ch34x_write_bulk_account(struct ch34x_pis *ch34x_dev,
+				     struct urb *urb, ktime_t start)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&ch34x_dev->tx_lock, flags);
+	ch34x_dev->tx_urbs++;
+	if (!(urb->transfer_flags & URB_NO_INTERRUPT))
+		ch34x_dev->tx_irqs++;
+	ch34x_dev->tx_bytes += urb->actual_length;
+	ch34x_dev->tx_callback_ns += ktime_to_ns(ktime_sub(ktime_get(), start));
+	spin_unlock_irqrestore(&ch34x_dev->tx_lock, flags);
+}
+
+static void ch34x_write_bulk_callback(struct urb *urb)
+{
+	struct ch34x_pis *ch34x_dev;
+
+	ch34x_dev = urb->context;
+	ch34x_write_bulk_status(ch34x_dev, urb);
+
+	/* free up our allocated buffer */
+	usb_free_coherent(urb->dev, urb->transfer_buffer_length,
+			  urb->transfer_buffer, urb->transfer_dma);
+	up(&ch34x_dev->limit_sem);
+}
+
 static int ch34x_flush(struct file *file, fl_owner_t id)
 {
 	struct ch34x_pis *ch34x_dev;
 	int res;
 
-	ch34x_dev = file->private_data;
+	ch34x_dev = ((struct ch34x_file *)file->private_data)->ch34x_dev;
 	if (ch34x_dev == NULL)
 		return -ENODEV;
 
-	/* wait for io to stop */
+	/*
+	 * wait for the writes of this session to go out, the shared streams
+	 * only stop with the last session
+	 */
 	mutex_lock(&ch34x_dev->io_mutex);
-	stop_data_traffic(ch34x_dev);
+	ch34x_stop_submitted(ch34x_dev);
+	if (ch34x_dev->sessions == 1)
+		ch34x_stop_streams(ch34x_dev);
 
 	/* read out errors, leave subsequent opens a clean slate */
 	spin_lock_irq(&ch34x_dev->err_lock);
@@ -539,11 +1337,74 @@ static int ch34x_flush(struct file *file, fl_owner_t id)
 	return res;
 }
 
+static void ch34x_busy_poll_callback(struct urb *urb)
+{
+	complete(urb->context);
+}
+
+/*
+ * Bulk in transfer which spins up to @busy_poll usecs for the urb to
+ * complete before it sleeps, short responses then skip the wakeup
+ * latency of usb_bulk_msg.
+ */
+static int ch34x_bulk_in_msg(struct ch34x_pis *ch34x_dev, void *data,
+			     int len, int *actual_length, u32 busy_poll)
+{
+	unsigned int pipe = usb_rcvbulkpipe(ch34x_dev->udev,
+					    ch34x_dev->bulk_in_endpointAddr);
+	struct completion done;
+	struct urb *urb;
+	unsigned long timeout;
+	ktime_t end;
+	int retval;
+
+	if (!busy_poll) {
+		retval = usb_bulk_msg(ch34x_dev->udev, pipe, data, len,
+				      actual_length, ch34x_dev->readtimeout);
+		if (retval == -EPIPE)
+			ch34x_halt_schedule(ch34x_dev, CH34X_HALT_IN);
+		return retval;
+	}
+
+	urb = usb_alloc_urb(0, GFP_KERNEL);
+	if (!urb)
+		return -ENOMEM;
+
+	init_completion(&done);
+	usb_fill_bulk_urb(urb, ch34x_dev->udev, pipe, data, len,
+			  ch34x_busy_poll_callback, &done);
+	retval = usb_submit_urb(urb, GFP_KERNEL);
+	if (retval)
+		goto exit;
+
+	end = ktime_add_us(ktime_get(), busy_poll);
+	while (!completion_done(&done) && !need_resched() &&
+	       ktime_before(ktime_get(), end))
+		cpu_relax();
+
+	timeout = ch34x_dev->readtimeout ?
+			  msecs_to_jiffies(ch34x_dev->readtimeout) :
+			  MAX_SCHEDULE_TIMEOUT;
+	if (!wait_for_completion_timeout(&done, timeout)) {
+		usb_kill_urb(urb);
+		retval = -ETIMEDOUT;
+	} else {
+		retval = urb->status;
+	}
+	*actual_length = urb->actual_length;
+	if (retval == -EPIPE)
+		ch34x_halt_schedule(ch34x_dev, CH34X_HALT_IN);
+
+exit:
+	usb_free_urb(urb);
+	return retval;
+}
+
 /*
  * Read operation for I2C/SPI interface.
  */
 static int ch34x_data_read(struct ch34x_pis *ch34x_dev, void *obuffer,
-			   u32 bytes_to_read)
+			   u32 bytes_to_read, u32 busy_poll)
 {
 	int bytes_read;
 	unsigned char *obuf;
@@ -572,11 +1433,8 @@ static int ch34x_data_read(struct ch34x_pis *ch34x_dev, void *obuffer,
 	}
 
 	mutex_lock(&ch34x_dev->io_mutex);
-	retval = usb_bulk_msg(
-		ch34x_dev->udev,
-		usb_rcvbulkpipe(ch34x_dev->udev,
-				ch34x_dev->bulk_in_endpointAddr),
-		obuf, bytes_to_read, &bytes_read, ch34x_dev->readtimeout);
+	retval = ch34x_bulk_in_msg(ch34x_dev, obuf, bytes_to_read,
+				   &bytes_read, busy_poll);
 	if (retval) {
 		mutex_unlock(&ch34x_dev->io_mutex);
 		goto error;
@@ -594,8 +1452,91 @@ exit:
 	return retval == 0 ? bytes_read : retval;
 }
 
+static u32 ch34x_tx_bufsize(struct ch34x_pis *ch34x_dev)
+{
+	return ch34x_dev->chiptype == CHIP_CH346C ? CH34X_TX_URB_SIZE :
+						    MAX_BUFFER_LENGTH;
+}
+
+/* take a transmit buffer from the cache, or allocate a new one */
+static void *ch34x_tx_buf_get(struct ch34x_pis *ch34x_dev, dma_addr_t *dma)
+{
+	struct ch34x_rb *rb;
+	unsigned long flags;
+	void *buf = NULL;
+
+	spin_lock_irqsave(&ch34x_dev->tx_lock, flags);
+	if (ch34x_dev->tx_cached) {
+		rb = &ch34x_dev->tx_cache[--ch34x_dev->tx_cached];
+		buf = rb->base;
+		*dma = rb->dma;
+	}
+	spin_unlock_irqrestore(&ch34x_dev->tx_lock, flags);
+
+	if (!buf)
+		buf = usb_alloc_coherent(ch34x_dev->udev,
+					 ch34x_tx_bufsize(ch34x_dev),
+					 GFP_KERNEL, dma);
+
+	return buf;
+}
+
+static bool ch34x_tx_buf_put(struct ch34x_pis *ch34x_dev, void *buf,
+			     dma_addr_t dma)
+{
+	struct ch34x_rb *rb;
+	unsigned long flags;
+	bool cached = false;
+
+	spin_lock_irqsave(&ch34x_dev->tx_lock, flags);
+	if (ch34x_dev->tx_cached < WRITES_IN_FLIGHT) {
+		rb = &ch34x_dev->tx_cache[ch34x_dev->tx_cached++];
+		rb->base = buf;
+		rb->dma = dma;
+		cached = true;
+	}
+	spin_unlock_irqrestore(&ch34x_dev->tx_lock, flags);
+
+	return cached;
+}
+
+static void ch34x_tx_bufs_free(struct ch34x_pis *ch34x_dev)
+{
+	struct ch34x_rb *rb;
+
+	while (ch34x_dev->tx_cached) {
+		rb = &ch34x_dev->tx_cache[--ch34x_dev->tx_cached];
+		usb_free_coherent(ch34x_dev->udev,
+				  ch34x_tx_bufsize(ch34x_dev), rb->base,
+				  rb->dma);
+	}
+}
+
+static void ch34x_data_write_callback(struct urb *urb)
+{
+	struct ch34x_pis *ch34x_dev = urb->context;
+	ktime_t start = ktime_get();
+
+	ch34x_write_bulk_status(ch34x_dev, urb);
+
+	/*
+	 * Give the buffer back to the cache. Completions of a coalesced
+	 * burst run back to back, so buffers are recycled in batches.
+	 */
+	if (!ch34x_tx_buf_put(ch34x_dev, urb->transfer_buffer,
+			      urb->transfer_dma))
+		usb_free_coherent(urb->dev, ch34x_tx_bufsize(ch34x_dev),
+				  urb->transfer_buffer, urb->transfer_dma);
+
+	ch34x_write_bulk_account(ch34x_dev, urb, start);
+	up(&ch34x_dev->limit_sem);
+}
+
 /*
  * Write operation for I2C/SPI/FIFO interface.
+ *
+ * Large writes go out as a burst of urbs, only every CH34X_TX_COALESCE-th
+ * and the last one ask the host controller for a completion interrupt.
  */
 static int ch34x_data_write(struct ch34x_pis *ch34x_dev, void *ibuffer,
 			    u32 count)
@@ -603,27 +1544,20 @@ static int ch34x_data_write(struct ch34x_pis *ch34x_dev, void *ibuffer,
 	unsigned char *ibuf;
 	int retval = 0;
 	struct urb *urb = NULL;
+	dma_addr_t dma;
 	u32 writesize;
-	u32 restlen = count;
 	u32 bytes_total = 0;
+	u32 bufsize = ch34x_tx_bufsize(ch34x_dev);
 	u32 maxlen = ch34x_dev->chiptype == CHIP_CH346C ?
 			     MAX_SLAVE_LENGTH :
 			     MAX_BUFFER_LENGTH;
+	int nurbs = 0;
 
 	if (count > maxlen || count <= 0) {
 		retval = -EINVAL;
 		goto exit;
 	}
 
-	/*
-	 * limit the number of URBs in flight to stop a user from using up all
-	 * RAM
-	 */
-	if (down_interruptible(&ch34x_dev->limit_sem)) {
-		retval = -ERESTARTSYS;
-		goto exit;
-	}
-
 	spin_lock_irq(&ch34x_dev->err_lock);
 	retval = ch34x_dev->errors;
 	if (retval < 0) {
@@ -635,7 +1569,17 @@ static int ch34x_data_write(struct ch34x_pis *ch34x_dev, void *ibuffer,
 		goto exit;
 
 send:
-	writesize = min_t(u32, restlen, maxlen);
+	writesize = min_t(u32, count - bytes_total, bufsize);
+	ibuf = NULL;
+
+	/*
+	 * limit the number of URBs in flight to stop a user from using up all
+	 * RAM
+	 */
+	if (down_interruptible(&ch34x_dev->limit_sem)) {
+		retval = -ERESTARTSYS;
+		goto exit;
+	}
 
 	/* create a urb, and a buffer for it, and copy the data to the urb */
 	urb = usb_alloc_urb(0, GFP_KERNEL);
@@ -644,17 +1588,17 @@ send:
 		goto error;
 	}
 
-	ibuf = usb_alloc_coherent(ch34x_dev->udev, writesize, GFP_KERNEL,
-				  &urb->transfer_dma);
+	ibuf = ch34x_tx_buf_get(ch34x_dev, &dma);
 	if (!ibuf) {
 		retval = -ENOMEM;
 		goto error;
 	}
 
-	retval = copy_from_user(ibuf, (char __user *)ibuffer + bytes_total,
-				writesize);
-	if (retval)
+	if (copy_from_user(ibuf, (char __user *)ibuffer + bytes_total,
+			   writesize)) {
+		retval = -EFAULT;
 		goto error;
+	}
 
 	mutex_lock(&ch34x_dev->io_mutex);
 	if (!ch34x_dev->interface) {
@@ -668,8 +1612,12 @@ send:
 		urb, ch34x_dev->udev,
 		usb_sndbulkpipe(ch34x_dev->udev,
 				ch34x_dev->bulk_out_endpointAddr),
-		ibuf, writesize, ch34x_write_bulk_callback, ch34x_dev);
+		ibuf, writesize, ch34x_data_write_callback, ch34x_dev);
+	urb->transfer_dma = dma;
 	urb->transfer_flags |= URB_NO_TRANSFER_DMA_MAP;
+	if (bytes_total + writesize < count &&
+	    ++nurbs % CH34X_TX_COALESCE)
+		urb->transfer_flags |= URB_NO_INTERRUPT;
 	usb_anchor_urb(urb, &ch34x_dev->submitted);
 
 	/* send the data out the bulk port */
@@ -687,9 +1635,9 @@ send:
 	 * it entirely
 	 */
 	usb_free_urb(urb);
+	urb = NULL;
 
 	bytes_total += writesize;
-	restlen -= writesize;
 	if (bytes_total < count)
 		goto send;
 
@@ -698,49 +1646,39 @@ send:
 error_unanchor:
 	usb_unanchor_urb(urb);
 error:
-	if (urb) {
-		usb_free_coherent(ch34x_dev->udev, count, ibuf,
-				  urb->transfer_dma);
+	if (ibuf && !ch34x_tx_buf_put(ch34x_dev, ibuf, dma))
+		usb_free_coherent(ch34x_dev->udev, bufsize, ibuf, dma);
+	if (urb)
 		usb_free_urb(urb);
-	}
 	up(&ch34x_dev->limit_sem);
 exit:
 	return retval;
 }
 
 /*
- * Write then Read operation for I2C/SPI interface.
+ * Write operation for parallel port write in EPP/MEM mode. Every packet
+ * carries the para_wmode command and CH34x_EPP_IO_MAX data bytes, framed
+ * straight into the transmit buffers, which go out as a burst like the
+ * ones of ch34x_data_write().
  */
-static int ch34x_data_write_read(struct ch34x_pis *ch34x_dev,
-				 void *ibuffer, void *obuffer,
-				 u32 readstep, u32 readtime, u32 count)
+static ssize_t ch34x_para_write(struct file *file,
+				const char __user *user_buffer,
+				size_t count, loff_t *file_pos)
 {
-	int bytes_read;
+	struct ch34x_pis *ch34x_dev =
+		((struct ch34x_file *)file->private_data)->ch34x_dev;
+	u32 bufsize = ch34x_tx_bufsize(ch34x_dev);
+	u32 per_urb = bufsize / CH341_PACKET_LENGTH * CH34x_EPP_IO_MAX;
 	unsigned char *ibuf;
-	unsigned char *obuf = NULL;
-	int retval = 0;
 	struct urb *urb = NULL;
-	int bytes_to_read;
-	int totallen = 0;
-	int i;
-	u32 writesize;
-	u32 restlen = count;
-	u32 bytes_total = 0;
+	dma_addr_t dma;
+	size_t totallen = 0;
+	u32 chunk, framed, len, i;
+	int nurbs = 0;
+	int retval;
 
-	bytes_to_read = readstep * readtime;
-	if (count > MAX_BUFFER_LENGTH ||
-	    bytes_to_read > MAX_BUFFER_LENGTH) {
-		retval = -EINVAL;
-		goto exit;
-	}
-	/*
-	 * limit the number of URBs in flight to stop a user from using up all
-	 * RAM
-	 */
-	if (down_interruptible(&ch34x_dev->limit_sem)) {
-		retval = -ERESTARTSYS;
-		goto exit;
-	}
+	if (count == 0)
+		return -EINVAL;
 
 	spin_lock_irq(&ch34x_dev->err_lock);
 	retval = ch34x_dev->errors;
@@ -750,36 +1688,183 @@ static int ch34x_data_write_read(struct ch34x_pis *ch34x_dev,
 	}
 	spin_unlock_irq(&ch34x_dev->err_lock);
 	if (retval < 0)
-		goto exit;
+		return retval;
+
+	while (totallen < count) {
+		chunk = min_t(size_t, count - totallen, per_urb);
+		ibuf = NULL;
+
+		/*
+		 * limit the number of URBs in flight to stop a user from
+		 * using up all RAM
+		 */
+		if (down_interruptible(&ch34x_dev->limit_sem)) {
+			retval = -ERESTARTSYS;
+			goto exit;
+		}
 
-	obuf = (char *)kmalloc(sizeof(unsigned char) * bytes_to_read,
-			       GFP_KERNEL);
-	if (!obuf) {
-		retval = -ENOMEM;
-		goto error;
-	}
+		urb = usb_alloc_urb(0, GFP_KERNEL);
+		if (!urb) {
+			retval = -ENOMEM;
+			goto error;
+		}
 
-send:
-	writesize = min_t(u32, restlen, MAX_TRANSFER);
+		ibuf = ch34x_tx_buf_get(ch34x_dev, &dma);
+		if (!ibuf) {
+			retval = -ENOMEM;
+			goto error;
+		}
 
-	/* create a urb, and a buffer for it, and copy the data to the urb */
-	urb = usb_alloc_urb(0, GFP_KERNEL);
-	if (!urb) {
-		retval = -ENOMEM;
-		goto error;
-	}
+		/* one packet per frame, only the last one may be short */
+		for (i = 0, framed = 0; i < chunk; i += len) {
+			len = min_t(u32, chunk - i, CH34x_EPP_IO_MAX);
+			ibuf[framed] = ch34x_dev->para_wmode;
+			if (copy_from_user(ibuf + framed + 1,
+					   user_buffer + totallen + i, len)) {
+				retval = -EFAULT;
+				goto error;
+			}
+			framed += len + 1;
+		}
 
-	ibuf = usb_alloc_coherent(ch34x_dev->udev, writesize, GFP_KERNEL,
-				  &urb->transfer_dma);
-	if (!ibuf) {
-		retval = -ENOMEM;
-		goto error;
+		mutex_lock(&ch34x_dev->io_mutex);
+		if (!ch34x_dev->interface) {
+			mutex_unlock(&ch34x_dev->io_mutex);
+			retval = -ENODEV;
+			goto error;
+		}
+
+		usb_fill_bulk_urb(
+			urb, ch34x_dev->udev,
+			usb_sndbulkpipe(ch34x_dev->udev,
+					ch34x_dev->bulk_out_endpointAddr),
+			ibuf, framed, ch34x_data_write_callback, ch34x_dev);
+		urb->transfer_dma = dma;
+		urb->transfer_flags |= URB_NO_TRANSFER_DMA_MAP;
+		if (totallen + chunk < count && ++nurbs % CH34X_TX_COALESCE)
+			urb->transfer_flags |= URB_NO_INTERRUPT;
+		usb_anchor_urb(urb, &ch34x_dev->submitted);
+
+		retval = usb_submit_urb(urb, GFP_KERNEL);
+		mutex_unlock(&ch34x_dev->io_mutex);
+		if (retval) {
+			dev_err(&ch34x_dev->interface->dev,
+				"%s - failed submitting write urb, error %d\n",
+				__func__, retval);
+			usb_unanchor_urb(urb);
+			goto error;
+		}
+
+		/*
+		 * release our reference to this urb, the USB core will
+		 * eventually free it entirely
+		 */
+		usb_free_urb(urb);
+		urb = NULL;
+		totallen += chunk;
 	}
 
-	retval = copy_from_user(ibuf, (char __user *)ibuffer + bytes_total,
-				writesize);
+	return totallen;
+
+error:
+	if (ibuf && !ch34x_tx_buf_put(ch34x_dev, ibuf, dma))
+		usb_free_coherent(ch34x_dev->udev, bufsize, ibuf, dma);
+	usb_free_urb(urb);
+	up(&ch34x_dev->limit_sem);
+exit:
+	return totallen ? totallen : retval;
+}
+
+static ssize_t ch34x_fops_write(struct file *file,
+				const char __user *user_buffer,
+				size_t count, loff_t *file_pos)
+{
+	struct ch34x_file *cfile = file->private_data;
+	ssize_t retval;
+
+	retval = ch34x_sched_enter(cfile);
 	if (retval)
+		return retval;
+	retval = ch34x_para_write(file, user_buffer, count, file_pos);
+	ch34x_sched_exit(cfile);
+
+	return retval;
+}
+
+/*
+ * Write then Read operation for I2C/SPI interface.
+ *
+ * All command packets go out in one urb and the responses are read with
+ * requests spanning all packets still expected, a short packet ends a
+ * request early. A stream of @readtime packets then costs a few frames
+ * instead of one transaction per packet.
+ */
+static int ch34x_data_write_read(struct ch34x_pis *ch34x_dev,
+				 void *ibuffer, void *obuffer,
+				 u32 readstep, u32 readtime, u32 count,
+				 u32 busy_poll)
+{
+	int bytes_read;
+	unsigned char *ibuf = NULL;
+	unsigned char *obuf = NULL;
+	int retval = 0;
+	struct urb *urb = NULL;
+	int bytes_to_read;
+	int totallen = 0;
+	u32 packets = 0;
+
+	bytes_to_read = readstep * readtime;
+	if (count == 0 || count > MAX_BUFFER_LENGTH ||
+	    bytes_to_read > MAX_BUFFER_LENGTH ||
+	    readtime > MAX_BUFFER_LENGTH / CH341_PACKET_LENGTH) {
+		retval = -EINVAL;
+		goto exit;
+	}
+	/*
+	 * limit the number of URBs in flight to stop a user from using up all
+	 * RAM
+	 */
+	if (down_interruptible(&ch34x_dev->limit_sem)) {
+		retval = -ERESTARTSYS;
+		goto exit;
+	}
+
+	spin_lock_irq(&ch34x_dev->err_lock);
+	retval = ch34x_dev->errors;
+	if (retval < 0) {
+		ch34x_dev->errors = 0;
+		retval = (retval == -EPIPE) ? retval : -EIO;
+	}
+	spin_unlock_irq(&ch34x_dev->err_lock);
+	if (retval < 0)
+		goto error;
+
+	/* every response packet may be a full one */
+	obuf = kmalloc(max_t(u32, bytes_to_read,
+			     readtime * CH341_PACKET_LENGTH), GFP_KERNEL);
+	if (!obuf) {
+		retval = -ENOMEM;
+		goto error;
+	}
+
+	/* create a urb, and a buffer for it, and copy the data to the urb */
+	urb = usb_alloc_urb(0, GFP_KERNEL);
+	if (!urb) {
+		retval = -ENOMEM;
+		goto error;
+	}
+
+	ibuf = usb_alloc_coherent(ch34x_dev->udev, count, GFP_KERNEL,
+				  &urb->transfer_dma);
+	if (!ibuf) {
+		retval = -ENOMEM;
+		goto error;
+	}
+
+	if (copy_from_user(ibuf, (char __user *)ibuffer, count)) {
+		retval = -EFAULT;
 		goto error;
+	}
 
 	mutex_lock(&ch34x_dev->io_mutex);
 	if (!ch34x_dev->interface) {
@@ -793,7 +1878,7 @@ send:
 		urb, ch34x_dev->udev,
 		usb_sndbulkpipe(ch34x_dev->udev,
 				ch34x_dev->bulk_out_endpointAddr),
-		ibuf, writesize, ch34x_write_bulk_callback, ch34x_dev);
+		ibuf, count, ch34x_write_bulk_callback, ch34x_dev);
 	urb->transfer_flags |= URB_NO_TRANSFER_DMA_MAP;
 	usb_anchor_urb(urb, &ch34x_dev->submitted);
 
@@ -810,30 +1895,23 @@ send:
 	}
 	/*
 	 * release our reference to this urb, the USB core will eventually free
-	 * it entirely
+	 * it entirely, the callback gives limit_sem back
 	 */
 	usb_free_urb(urb);
 
-	bytes_total += writesize;
-	restlen -= writesize;
-	if (bytes_total < count)
-		goto send;
-
-	for (i = 0; i < readtime; i++) {
+	while (packets < readtime) {
 		mutex_lock(&ch34x_dev->io_mutex);
-		retval = usb_bulk_msg(
-			ch34x_dev->udev,
-			usb_rcvbulkpipe(ch34x_dev->udev,
-					ch34x_dev->bulk_in_endpointAddr),
-			obuf + totallen, CH341_PACKET_LENGTH, &bytes_read,
-			ch34x_dev->readtimeout);
-
-		if (retval) {
-			mutex_unlock(&ch34x_dev->io_mutex);
+		retval = ch34x_bulk_in_msg(ch34x_dev, obuf + totallen,
+					   (readtime - packets) *
+						   CH341_PACKET_LENGTH,
+					   &bytes_read, busy_poll);
+		mutex_unlock(&ch34x_dev->io_mutex);
+		if (retval)
 			goto error1;
-		}
 		totallen += bytes_read;
-		mutex_unlock(&ch34x_dev->io_mutex);
+		/* a zero length packet is a response as well */
+		packets += max_t(u32, DIV_ROUND_UP(bytes_read,
+						   CH341_PACKET_LENGTH), 1);
 	}
 
 	retval = copy_to_user((char __user *)obuffer, obuf, totallen);
@@ -842,22 +1920,20 @@ send:
 		goto error1;
 	}
 
-	if (obuf)
-		kfree(obuf);
+	kfree(obuf);
 	return totallen;
 
 error1:
-	if (obuf)
-		kfree(obuf);
+	kfree(obuf);
 	return retval;
 error_unanchor:
 	usb_unanchor_urb(urb);
 error:
-	if (obuf)
-		kfree(obuf);
+	kfree(obuf);
 	if (urb) {
-		usb_free_coherent(ch34x_dev->udev, count, ibuf,
-				  urb->transfer_dma);
+		if (ibuf)
+			usb_free_coherent(ch34x_dev->udev, count, ibuf,
+					  urb->transfer_dma);
 		usb_free_urb(urb);
 	}
 	up(&ch34x_dev->limit_sem);
@@ -865,154 +1941,2200 @@ exit:
 	return retval;
 }
 
-static int ch34x_start_read_io(struct ch34x_pis *ch34x_dev)
+/*
+ * Short command slipped in between the packets of a long job, its
+ * response is picked out of the job's response stream by command code.
+ */
+struct ch34x_lane_req {
+	struct list_head list;
+	u8 *obuf;
+	u32 olen;
+	u8 *ibuf;
+	u32 ilen;
+	u32 got;
+	bool sent;
+	int status;
+	struct completion done;
+};
+
+static void ch34x_lane_open(struct ch34x_pis *ch34x_dev)
 {
-	int retval = -ENODEV;
-	int i;
+	spin_lock(&ch34x_dev->lane_lock);
+	ch34x_dev->lane_open = true;
+	spin_unlock(&ch34x_dev->lane_lock);
+}
 
-	mutex_lock(&ch34x_dev->io_mutex);
-	if (ch34x_dev->interface == NULL)
-		goto disconnected;
+/* hand unsent requests back to their callers, fail unanswered ones */
+static void ch34x_lane_close(struct ch34x_pis *ch34x_dev)
+{
+	struct ch34x_lane_req *req, *next;
+
+	spin_lock(&ch34x_dev->lane_lock);
+	ch34x_dev->lane_open = false;
+	list_for_each_entry_safe(req, next, &ch34x_dev->lane_queue, list) {
+		list_del_init(&req->list);
+		req->status = req->sent ? -EIO : -EAGAIN;
+		complete(&req->done);
+	}
+	spin_unlock(&ch34x_dev->lane_lock);
+}
 
-	retval = usb_autopm_get_interface(ch34x_dev->interface);
-	if (retval)
-		goto error_get_interface;
+/*
+ * Copy the next unsent command to @buf if it fits in @size bytes.
+ * Returns its length, the length of its response goes to @rsp_len.
+ */
+static int ch34x_lane_take(struct ch34x_pis *ch34x_dev, u8 *buf, int size,
+			   u32 *rsp_len)
+{
+	struct ch34x_lane_req *req;
+	int len = 0;
+
+	spin_lock(&ch34x_dev->lane_lock);
+	list_for_each_entry(req, &ch34x_dev->lane_queue, list) {
+		if (req->sent)
+			continue;
+		if (req->olen <= size) {
+			memcpy(buf, req->obuf, req->olen);
+			req->sent = true;
+			len = req->olen;
+			*rsp_len = req->ilen;
+		}
+		break;
+	}
+	spin_unlock(&ch34x_dev->lane_lock);
 
-	retval = ch34x_submit_read_urbs(ch34x_dev, GFP_KERNEL);
-	if (retval)
-		goto error_submit_read_urbs;
+	return len;
+}
 
-	usb_autopm_put_interface(ch34x_dev->interface);
-	mutex_unlock(&ch34x_dev->io_mutex);
+/* send the queued commands, the caller has in urbs for the responses */
+static int ch34x_lane_send(struct ch34x_pis *ch34x_dev, u8 *buf)
+{
+	u32 rsp_len;
+	int retval;
+	int len;
 
-	return 0;
+	for (;;) {
+		len = ch34x_lane_take(ch34x_dev, buf, CH347_PACKET_LENGTH,
+				      &rsp_len);
+		if (!len)
+			return 0;
+		retval = usb_bulk_msg(
+			ch34x_dev->udev,
+			usb_sndbulkpipe(ch34x_dev->udev,
+					ch34x_dev->bulk_out_endpointAddr),
+			buf, len, NULL, ch34x_dev->writetimeout);
+		if (retval)
+			return retval;
+	}
+}
 
-error_submit_read_urbs:
-	for (i = 0; i < ch34x_dev->rx_buflimit; i++)
-		usb_kill_urb(ch34x_dev->read_urbs[i]);
-error_get_interface:
-disconnected:
+static struct ch34x_lane_req *ch34x_lane_route(struct ch34x_pis *ch34x_dev,
+					       u8 cmd)
+{
+	struct ch34x_lane_req *req, *found = NULL;
+
+	spin_lock(&ch34x_dev->lane_lock);
+	list_for_each_entry(req, &ch34x_dev->lane_queue, list) {
+		if (req->sent && req->obuf[0] == cmd) {
+			found = req;
+			break;
+		}
+	}
+	spin_unlock(&ch34x_dev->lane_lock);
+
+	return found;
+}
+
+static void ch34x_lane_done(struct ch34x_pis *ch34x_dev,
+			    struct ch34x_lane_req *req)
+{
+	spin_lock(&ch34x_dev->lane_lock);
+	list_del_init(&req->list);
+	req->status = 0;
+	complete(&req->done);
+	spin_unlock(&ch34x_dev->lane_lock);
+}
+
+/*
+ * Write then read a short command like GPIO_OP, whose response frame is
+ * headed by the same command code. While a long job holds the device the
+ * command is slipped in between the job's packets instead of waiting for
+ * the whole job.
+ */
+static int ch34x_lane_xfer(struct ch34x_file *cfile, void *obuffer,
+			   u32 olen, void *ibuffer, u32 ilen)
+{
+	struct ch34x_pis *ch34x_dev = cfile->ch34x_dev;
+	struct ch34x_lane_req req = {};
+	bool queued = false;
+	int actual;
+	int retval;
+	u8 *buf;
+
+	if (ch34x_dev->chiptype == CHIP_CH341)
+		return -EOPNOTSUPP;
+
+	if (olen == 0 || olen > CH347_PACKET_LENGTH ||
+	    ilen < USB20_CMD_HEADER || ilen > CH347_PACKET_LENGTH)
+		return -EINVAL;
+
+	buf = kmalloc(CH347_PACKET_LENGTH * 2, GFP_KERNEL);
+	if (!buf)
+		return -ENOMEM;
+
+	req.obuf = buf;
+	req.olen = olen;
+	req.ibuf = buf + CH347_PACKET_LENGTH;
+	req.ilen = ilen;
+	INIT_LIST_HEAD(&req.list);
+	init_completion(&req.done);
+
+	if (copy_from_user(req.obuf, (char __user *)obuffer, olen)) {
+		retval = -EFAULT;
+		goto exit;
+	}
+
+	spin_lock(&ch34x_dev->lane_lock);
+	if (ch34x_dev->lane_open) {
+		list_add_tail(&req.list, &ch34x_dev->lane_queue);
+		queued = true;
+	}
+	spin_unlock(&ch34x_dev->lane_lock);
+
+	/* the job completes every request it holds on its way out */
+	if (queued) {
+		retval = wait_for_completion_interruptible(&req.done);
+		if (retval) {
+			spin_lock(&ch34x_dev->lane_lock);
+			if (!req.sent && !list_empty(&req.list)) {
+				list_del_init(&req.list);
+				spin_unlock(&ch34x_dev->lane_lock);
+				goto exit;
+			}
+			spin_unlock(&ch34x_dev->lane_lock);
+			wait_for_completion(&req.done);
+		}
+		retval = req.status;
+		if (retval != -EAGAIN)
+			goto done;
+	}
+
+	/* no job to ride on, take the device as usual */
+	retval = ch34x_sched_enter(cfile);
+	if (retval)
+		goto exit;
+	mutex_lock(&ch34x_dev->io_mutex);
+	if (!ch34x_dev->interface) {
+		mutex_unlock(&ch34x_dev->io_mutex);
+		ch34x_sched_exit(cfile);
+		retval = -ENODEV;
+		goto exit;
+	}
+	retval = usb_bulk_msg(ch34x_dev->udev,
+			      usb_sndbulkpipe(ch34x_dev->udev,
+					      ch34x_dev->bulk_out_endpointAddr),
+			      req.obuf, olen, &actual,
+			      ch34x_dev->writetimeout);
+	if (!retval)
+		retval = ch34x_bulk_in_msg(ch34x_dev, req.ibuf, ilen, &actual,
+					   cfile->busy_poll);
 	mutex_unlock(&ch34x_dev->io_mutex);
-	return usb_translate_errors(retval);
+	ch34x_sched_exit(cfile);
+	if (!retval)
+		req.got = actual;
+
+done:
+	if (!retval && copy_to_user((char __user *)ibuffer, req.ibuf,
+				    req.got))
+		retval = -EFAULT;
+	if (!retval)
+		retval = req.got;
+exit:
+	kfree(buf);
+	return retval;
 }
 
-static int ch34x_stop_read_io(struct ch34x_pis *ch34x_dev)
+/*
+ * Parser for the command response stream of ch347/ch339/ch346, every
+ * response packet is made of a 3-byte header (cmd, len_lo, len_hi),
+ * an optional fill byte and the payload, which is handed to @sink.
+ * A zero @cmd accepts any command, @end gets the length of each frame.
+ * With @lane_dev set, frames of other commands go to the short commands
+ * slipped in on that device.
+ */
+struct ch34x_cmd_parser {
+	u8 cmd[2];
+	u8 hdr[USB20_CMD_HEADER + 1];
+	int hdr_len;
+	int hdr_got;
+	u32 frame_left;
+	int (*sink)(void *context, u8 cmd, const u8 *data, u32 len);
+	int (*end)(void *context, u8 cmd, u32 len); /* optional */
+	void *context;
+	struct ch34x_pis *lane_dev;
+	struct ch34x_lane_req *lane_req; /* owner of the current frame */
+};
+
+static void ch34x_cmd_parser_init(struct ch34x_cmd_parser *parser, u8 cmd,
+				  u8 cmd2, bool fill_byte,
+				  int (*sink)(void *, u8, const u8 *, u32),
+				  void *context)
 {
-	int i;
+	parser->cmd[0] = cmd;
+	parser->cmd[1] = cmd2;
+	parser->hdr_len = USB20_CMD_HEADER + (fill_byte ? 1 : 0);
+	parser->hdr_got = 0;
+	parser->frame_left = 0;
+	parser->sink = sink;
+	parser->end = NULL;
+	parser->context = context;
+	parser->lane_dev = NULL;
+	parser->lane_req = NULL;
+}
 
-	if (ch34x_dev->interface == NULL)
-		return -ENODEV;
+static int ch34x_cmd_parser_end(struct ch34x_cmd_parser *parser)
+{
+	u32 len = parser->hdr_len + (parser->hdr[1] | (parser->hdr[2] << 8));
 
-	for (i = 0; i < ch34x_dev->rx_buflimit; i++)
-		usb_kill_urb(ch34x_dev->read_urbs[i]);
+	parser->hdr_got = 0;
+	if (parser->lane_req) {
+		ch34x_lane_done(parser->lane_dev, parser->lane_req);
+		parser->lane_req = NULL;
+		return 0;
+	}
+	if (!parser->end)
+		return 0;
+
+	return parser->end(parser->context, parser->hdr[0], len);
+}
+
+/* start a frame of a short command, the header goes to its buffer too */
+static int ch34x_cmd_parser_lane(struct ch34x_cmd_parser *parser)
+{
+	struct ch34x_lane_req *req;
+	u32 extra = parser->hdr_len - USB20_CMD_HEADER;
+	u32 len = parser->hdr[1] | (parser->hdr[2] << 8);
+
+	if (!parser->lane_dev)
+		return -EPROTO;
+	req = ch34x_lane_route(parser->lane_dev, parser->hdr[0]);
+	if (!req)
+		return -EPROTO;
+	/* a fill byte of the job is the first payload byte here */
+	if (len < extra || USB20_CMD_HEADER + len > req->ilen)
+		return -EOVERFLOW;
+
+	memcpy(req->ibuf, parser->hdr, parser->hdr_len);
+	req->got = parser->hdr_len;
+	parser->lane_req = req;
+	parser->frame_left = len - extra;
+	if (!parser->frame_left)
+		return ch34x_cmd_parser_end(parser);
 
 	return 0;
 }
 
-static u32 ch34x_query_slave_fifo(struct ch34x_pis *ch34x_dev)
+static int ch34x_cmd_parser_feed(struct ch34x_cmd_parser *parser,
+				 const u8 *src, u32 len)
 {
-	unsigned long flags;
-	u32 fifolen;
+	u32 n;
+	int retval;
 
-	spin_lock_irqsave(&ch34x_dev->read_lock, flags);
-	fifolen = kfifo_len(&ch34x_dev->rfifo);
-	spin_unlock_irqrestore(&ch34x_dev->read_lock, flags);
+	while (len) {
+		if (parser->hdr_got < parser->hdr_len) {
+			parser->hdr[parser->hdr_got++] = *src++;
+			len--;
+			if (parser->hdr_got < parser->hdr_len)
+				continue;
+			if (parser->cmd[0] &&
+			    parser->hdr[0] != parser->cmd[0] &&
+			    parser->hdr[0] != parser->cmd[1]) {
+				retval = ch34x_cmd_parser_lane(parser);
+				if (retval)
+					return retval;
+				continue;
+			}
+			parser->frame_left =
+				parser->hdr[1] | (parser->hdr[2] << 8);
+			if (!parser->frame_left) {
+				retval = ch34x_cmd_parser_end(parser);
+				if (retval)
+					return retval;
+			}
+			continue;
+		}
 
-	return fifolen;
+		n = min_t(u32, len, parser->frame_left);
+		if (parser->lane_req) {
+			memcpy(parser->lane_req->ibuf + parser->lane_req->got,
+			       src, n);
+			parser->lane_req->got += n;
+		} else {
+			retval = parser->sink(parser->context, parser->hdr[0],
+					      src, n);
+			if (retval)
+				return retval;
+		}
+		src += n;
+		len -= n;
+		parser->frame_left -= n;
+		if (!parser->frame_left) {
+			retval = ch34x_cmd_parser_end(parser);
+			if (retval)
+				return retval;
+		}
+	}
+
+	return 0;
 }
 
-static void ch34x_reset_slave_fifo(struct ch34x_pis *ch34x_dev)
+/* sink of ch34x_cmd_parser, copy the payload to user space */
+struct ch34x_user_sink {
+	char __user *to_user;
+	u32 done;
+	u32 total;
+};
+
+static int ch34x_user_sink(void *context, u8 cmd, const u8 *data, u32 len)
 {
-	unsigned long flags;
+	struct ch34x_user_sink *us = context;
 
-	spin_lock_irqsave(&ch34x_dev->read_lock, flags);
-	kfifo_reset(&ch34x_dev->rfifo);
-	spin_unlock_irqrestore(&ch34x_dev->read_lock, flags);
+	if (len > us->total - us->done)
+		return -EOVERFLOW;
+	if (copy_to_user(us->to_user + us->done, data, len))
+		return -EFAULT;
+	us->done += len;
+
+	return 0;
 }
 
-static int ch34x_slave_fifo_read(struct ch34x_pis *ch34x_dev,
-				 void *obuffer, u32 bytes_to_read)
+static int ch34x_spi_block_read_cmd(struct ch34x_pis *ch34x_dev, u8 *cmdbuf,
+				    u32 len)
 {
-	int bytes_read;
-	unsigned char *obuf;
-	int retval = 0;
-	int fifolen;
+	cmdbuf[0] = USB20_CMD_SPI_BLCK_RD;
+	cmdbuf[1] = 0x04;
+	cmdbuf[2] = 0x00;
+	cmdbuf[3] = (u8)(len >> 0);
+	cmdbuf[4] = (u8)(len >> 8);
+	cmdbuf[5] = (u8)(len >> 16);
+	cmdbuf[6] = (u8)(len >> 24);
+
+	return usb_bulk_msg(ch34x_dev->udev,
+			    usb_sndbulkpipe(ch34x_dev->udev,
+					    ch34x_dev->bulk_out_endpointAddr),
+			    cmdbuf, USB20_CMD_HEADER + 4, NULL,
+			    ch34x_dev->writetimeout);
+}
+
+/*
+ * Block read operation for SPI interface, send USB20_CMD_SPI_BLCK_RD
+ * with a 32-bit length and keep CH34X_BLKRD_URBS urbs queued until the
+ * whole payload has been delivered to user space. The block is read in
+ * chunks of CH34X_LANE_CHUNK, short commands queued by other threads
+ * are sent in between.
+ */
+static int ch34x_spi_block_read(struct ch34x_pis *ch34x_dev, void *obuffer,
+				u32 bytes_to_read, u32 flags)
+{
+	struct ch34x_blkrd_urb bu[CH34X_BLKRD_URBS] = {};
+	struct ch34x_cmd_parser parser;
+	struct ch34x_user_sink us = {
+		.to_user = (char __user *)obuffer,
+		.total = bytes_to_read,
+	};
+	unsigned char *cmdbuf;
+	size_t urbsize = ch34x_dev->bulk_in_size;
+	u32 sent, chunk;
+	long timeleft, timeout;
+	int retval;
+	int i, cur;
+
+	if (ch34x_dev->chiptype == CHIP_CH341)
+		return -EOPNOTSUPP;
+
+	if ((bytes_to_read > CH34X_BLKRD_MAX_LENGTH) || (bytes_to_read == 0))
+		return -EINVAL;
+
+	timeout = ch34x_dev->readtimeout ?
+			  msecs_to_jiffies(ch34x_dev->readtimeout) :
+			  MAX_SCHEDULE_TIMEOUT;
+
+	spin_lock_irq(&ch34x_dev->err_lock);
+	retval = ch34x_dev->errors;
+	if (retval < 0) {
+		ch34x_dev->errors = 0;
+		retval = (retval == -EPIPE) ? retval : -EIO;
+	}
+	spin_unlock_irq(&ch34x_dev->err_lock);
+	if (retval < 0)
+		return retval;
+
+	cmdbuf = kmalloc(CH347_PACKET_LENGTH, GFP_KERNEL);
+	if (!cmdbuf)
+		return -ENOMEM;
+
+	for (i = 0; i < CH34X_BLKRD_URBS; i++) {
+		bu[i].urb = usb_alloc_urb(0, GFP_KERNEL);
+		if (!bu[i].urb) {
+			retval = -ENOMEM;
+			goto error;
+		}
+		bu[i].buf = usb_alloc_coherent(ch34x_dev->udev, urbsize,
+					       GFP_KERNEL,
+					       &bu[i].urb->transfer_dma);
+		if (!bu[i].buf) {
+			retval = -ENOMEM;
+			goto error;
+		}
+		init_completion(&bu[i].done);
+	}
+
+	ch34x_cmd_parser_init(&parser, USB20_CMD_SPI_BLCK_RD,
+			      USB20_CMD_SPI_BLCK_RD,
+			      flags & CH34x_BLKRD_FILL_BYTE, ch34x_user_sink,
+			      &us);
+	parser.lane_dev = ch34x_dev;
+
+	mutex_lock(&ch34x_dev->io_mutex);
+	if (!ch34x_dev->interface) {
+		mutex_unlock(&ch34x_dev->io_mutex);
+		retval = -ENODEV;
+		goto error;
+	}
+
+	/* queue the in urbs ahead of the command, no response gets lost */
+	for (i = 0; i < CH34X_BLKRD_URBS; i++) {
+		usb_fill_bulk_urb(
+			bu[i].urb, ch34x_dev->udev,
+			usb_rcvbulkpipe(ch34x_dev->udev,
+					ch34x_dev->bulk_in_endpointAddr),
+			bu[i].buf, urbsize, ch34x_blkrd_callback, &bu[i]);
+		bu[i].urb->transfer_flags |= URB_NO_TRANSFER_DMA_MAP;
+		retval = usb_submit_urb(bu[i].urb, GFP_KERNEL);
+		if (retval)
+			goto error_kill;
+	}
+
+	/*
+	 * Read in chunks, short commands of other threads get in between
+	 * them instead of waiting for the whole block.
+	 */
+	ch34x_lane_open(ch34x_dev);
+	chunk = min_t(u32, bytes_to_read, CH34X_LANE_CHUNK);
+	retval = ch34x_spi_block_read_cmd(ch34x_dev, cmdbuf, chunk);
+	if (retval)
+		goto error_kill;
+	sent = chunk;
+
+	/* bulk urbs of one endpoint complete in submission order */
+	for (cur = 0;; cur = (cur + 1) % CH34X_BLKRD_URBS) {
+		timeleft = wait_for_completion_interruptible_timeout(
+			&bu[cur].done, timeout);
+		if (timeleft <= 0) {
+			retval = timeleft ? timeleft : -ETIMEDOUT;
+			goto error_kill;
+		}
+		retval = bu[cur].urb->status;
+		if (retval) {
+			if (retval == -EPIPE) {
+				spin_lock_irq(&ch34x_dev->err_lock);
+				ch34x_dev->errors = retval;
+				spin_unlock_irq(&ch34x_dev->err_lock);
+				ch34x_halt_schedule(ch34x_dev, CH34X_HALT_IN);
+			}
+			goto error_kill;
+		}
+
+		retval = ch34x_cmd_parser_feed(&parser, bu[cur].buf,
+					       bu[cur].urb->actual_length);
+		if (retval)
+			goto error_kill;
+
+		if (us.done >= bytes_to_read)
+			break;
+
+		/* the device is idle between chunks */
+		if (us.done == sent) {
+			retval = ch34x_lane_send(ch34x_dev, cmdbuf);
+			if (retval)
+				goto error_kill;
+			chunk = min_t(u32, bytes_to_read - sent,
+				      CH34X_LANE_CHUNK);
+			retval = ch34x_spi_block_read_cmd(ch34x_dev, cmdbuf,
+							  chunk);
+			if (retval)
+				goto error_kill;
+			sent += chunk;
+		}
+
+		reinit_completion(&bu[cur].done);
+		retval = usb_submit_urb(bu[cur].urb, GFP_KERNEL);
+		if (retval)
+			goto error_kill;
+	}
+	retval = 0;
+
+error_kill:
+	ch34x_lane_close(ch34x_dev);
+	for (i = 0; i < CH34X_BLKRD_URBS; i++)
+		usb_kill_urb(bu[i].urb);
+	mutex_unlock(&ch34x_dev->io_mutex);
+error:
+	for (i = 0; i < CH34X_BLKRD_URBS; i++) {
+		if (bu[i].buf)
+			usb_free_coherent(ch34x_dev->udev, urbsize, bu[i].buf,
+					  bu[i].urb->transfer_dma);
+		usb_free_urb(bu[i].urb);
+	}
+	kfree(cmdbuf);
+
+	return retval == 0 ? us.done : retval;
+}
+
+/*
+ * Size of an aggregated in urb for @due response bytes. It is always a
+ * whole number of packets, an urb shorter than the packet the chip
+ * sends would overflow.
+ */
+static u32 ch34x_agg_size(struct ch34x_pis *ch34x_dev, u32 due)
+{
+	return roundup(min_t(u32, due, CH34X_AGG_URB_SIZE),
+		       ch34x_dev->bulk_in_size);
+}
+
+/* frame table of CH34x_PIPE_READ_FRAMES */
+struct ch34x_frame_sink {
+	u32 __user *frames;
+	u32 nframes;
+	u32 count;
+};
+
+static int ch34x_frame_payload(void *context, u8 cmd, const u8 *data,
+			       u32 len)
+{
+	return 0;
+}
+
+static int ch34x_frame_end(void *context, u8 cmd, u32 len)
+{
+	struct ch34x_frame_sink *fs = context;
+
+	if (fs->count >= fs->nframes)
+		return -ENOSPC;
+	if (put_user(len, fs->frames + fs->count))
+		return -EFAULT;
+	fs->count++;
+
+	return 0;
+}
+
+/*
+ * Read @bytes_to_read bytes of command responses with in urbs of up to
+ * CH34X_AGG_URB_SIZE, each collecting many packets, and split the
+ * stream into frames. The length of every complete frame is stored in
+ * the table of @nframes entries at @frames. On a timeout the data that
+ * has arrived so far is returned.
+ *
+ * A short packet ends an urb, so each urb is only sure to get one
+ * packet: no more urbs than bytes due are queued, the ones left over
+ * at the end are killed.
+ */
+static int ch34x_read_frames(struct ch34x_pis *ch34x_dev, void *obuffer,
+			     u32 bytes_to_read, u32 flags, u32 __user *frames,
+			     u32 *nframes)
+{
+	struct ch34x_blkrd_urb bu[CH34X_AGG_URBS] = {};
+	struct ch34x_cmd_parser parser;
+	struct ch34x_frame_sink fs = {
+		.frames = frames,
+		.nframes = *nframes,
+	};
+	char __user *to_user = (char __user *)obuffer;
+	size_t urbsize = ch34x_agg_size(ch34x_dev, bytes_to_read);
+	u32 got = 0, size;
+	int head = 0, cur = 0, inflight = 0;
+	unsigned int inpipe;
+	long timeleft, timeout;
+	int retval;
+	int i;
+
+	if (ch34x_dev->chiptype == CHIP_CH341)
+		return -EOPNOTSUPP;
+
+	if ((bytes_to_read > CH34X_AGG_MAX_LENGTH) || (bytes_to_read == 0))
+		return -EINVAL;
+
+	timeout = ch34x_dev->readtimeout ?
+			  msecs_to_jiffies(ch34x_dev->readtimeout) :
+			  MAX_SCHEDULE_TIMEOUT;
+
+	spin_lock_irq(&ch34x_dev->err_lock);
+	retval = ch34x_dev->errors;
+	if (retval < 0) {
+		ch34x_dev->errors = 0;
+		retval = (retval == -EPIPE) ? retval : -EIO;
+	}
+	spin_unlock_irq(&ch34x_dev->err_lock);
+	if (retval < 0)
+		return retval;
+
+	for (i = 0; i < CH34X_AGG_URBS; i++) {
+		bu[i].urb = usb_alloc_urb(0, GFP_KERNEL);
+		if (!bu[i].urb) {
+			retval = -ENOMEM;
+			goto error;
+		}
+		bu[i].buf = usb_alloc_coherent(ch34x_dev->udev, urbsize,
+					       GFP_KERNEL,
+					       &bu[i].urb->transfer_dma);
+		if (!bu[i].buf) {
+			retval = -ENOMEM;
+			goto error;
+		}
+		init_completion(&bu[i].done);
+	}
+
+	ch34x_cmd_parser_init(&parser, 0, 0, flags & CH34x_FRAMES_FILL_BYTE,
+			      ch34x_frame_payload, &fs);
+	parser.end = ch34x_frame_end;
+
+	mutex_lock(&ch34x_dev->io_mutex);
+	if (!ch34x_dev->interface) {
+		mutex_unlock(&ch34x_dev->io_mutex);
+		retval = -ENODEV;
+		goto error;
+	}
+
+	inpipe = usb_rcvbulkpipe(ch34x_dev->udev,
+				 ch34x_dev->bulk_in_endpointAddr);
+	for (;;) {
+		while (inflight < CH34X_AGG_URBS &&
+		       got + inflight < bytes_to_read) {
+			size = ch34x_agg_size(ch34x_dev, bytes_to_read - got);
+			usb_fill_bulk_urb(bu[head].urb, ch34x_dev->udev,
+					  inpipe, bu[head].buf, size,
+					  ch34x_blkrd_callback, &bu[head]);
+			bu[head].urb->transfer_flags |= URB_NO_TRANSFER_DMA_MAP;
+			reinit_completion(&bu[head].done);
+			retval = usb_submit_urb(bu[head].urb, GFP_KERNEL);
+			if (retval)
+				goto error_kill;
+			inflight++;
+			head = (head + 1) % CH34X_AGG_URBS;
+		}
+
+		/* bulk urbs of one endpoint complete in submission order */
+		timeleft = wait_for_completion_interruptible_timeout(
+			&bu[cur].done, timeout);
+		if (timeleft <= 0) {
+			/* keep what the urb got before it was cut short */
+			usb_kill_urb(bu[cur].urb);
+			retval = timeleft ? timeleft : -ETIMEDOUT;
+		} else {
+			retval = bu[cur].urb->status;
+		}
+		if (retval && retval != -ENOENT && retval != -ETIMEDOUT) {
+			if (retval == -EPIPE) {
+				spin_lock_irq(&ch34x_dev->err_lock);
+				ch34x_dev->errors = retval;
+				spin_unlock_irq(&ch34x_dev->err_lock);
+				ch34x_halt_schedule(ch34x_dev, CH34X_HALT_IN);
+			}
+			goto error_kill;
+		}
+
+		size = min_t(u32, bu[cur].urb->actual_length,
+			     bytes_to_read - got);
+		if (copy_to_user(to_user + got, bu[cur].buf, size)) {
+			retval = -EFAULT;
+			goto error_kill;
+		}
+		retval = ch34x_cmd_parser_feed(&parser, bu[cur].buf, size);
+		if (retval)
+			goto error_kill;
+		got += size;
+		inflight--;
+		cur = (cur + 1) % CH34X_AGG_URBS;
+
+		if (timeleft <= 0) {
+			retval = got ? 0 : (timeleft ? timeleft : -ETIMEDOUT);
+			break;
+		}
+		if (got >= bytes_to_read) {
+			retval = 0;
+			break;
+		}
+	}
+
+error_kill:
+	for (i = 0; i < CH34X_AGG_URBS; i++)
+		usb_kill_urb(bu[i].urb);
+	mutex_unlock(&ch34x_dev->io_mutex);
+error:
+	for (i = 0; i < CH34X_AGG_URBS; i++) {
+		if (bu[i].buf)
+			usb_free_coherent(ch34x_dev->udev, urbsize, bu[i].buf,
+					  bu[i].urb->transfer_dma);
+		usb_free_urb(bu[i].urb);
+	}
+
+	*nframes = fs.count;
+
+	return retval == 0 ? got : retval;
+}
+
+/* JTAG shift job of CH34x_JTAG_SHIFT */
+struct ch34x_jtag_xfer {
+	char __user *data; /* TDI bits in, TDO bits out, LSB first */
+	u32 bits;
+	u32 flags;
+	u8 trst;
+	u32 fast_bytes; /* bytes moved with USB20_CMD_JTAG_DATA_SHIFT */
+	u32 tail_bits; /* bits moved with USB20_CMD_JTAG_BIT_OP */
+	u32 byte_pos;
+	bool entered;
+	bool tailed;
+	bool exited;
+	u32 tdo_bits;
+	u8 tdo_acc;
+	u32 rsp_bytes; /* responses due for the packets built so far */
+};
+
+static int ch34x_jtag_build_enter(struct ch34x_jtag_xfer *jx, u8 *buf)
+{
+	u8 trst = jx->trst;
+	int i = USB20_CMD_HEADER;
+
+	/* Run-Test/Idle -> Select-DR-Scan [-> Select-IR-Scan] -> Shift */
+	if (jx->flags & CH34x_JTAG_ENTER_DR) {
+		buf[i++] = JTAG_TMS_L | JTAG_TDI_H | JTAG_TCK_H | trst;
+		buf[i++] = JTAG_TMS_L | JTAG_TDI_H | JTAG_TCK_L | trst;
+	}
+	buf[i++] = JTAG_TMS_H | JTAG_TDI_H | JTAG_TCK_L | trst;
+	buf[i++] = JTAG_TMS_H | JTAG_TDI_H | JTAG_TCK_H | trst;
+	if (jx->flags & CH34x_JTAG_ENTER_IR) {
+		buf[i++] = JTAG_TMS_H | JTAG_TDI_H | JTAG_TCK_L | trst;
+		buf[i++] = JTAG_TMS_H | JTAG_TDI_H | JTAG_TCK_H | trst;
+	}
+	buf[i++] = JTAG_TMS_L | JTAG_TDI_H | JTAG_TCK_L | trst;
+	buf[i++] = JTAG_TMS_L | JTAG_TDI_H | JTAG_TCK_H | trst;
+	buf[i++] = JTAG_TMS_L | JTAG_TDI_H | JTAG_TCK_L | trst;
+	buf[i++] = JTAG_TMS_L | JTAG_TDI_H | JTAG_TCK_H | trst;
+	buf[i++] = JTAG_TMS_L | JTAG_TDI_H | JTAG_TCK_L | trst;
+
+	buf[0] = USB20_CMD_JTAG_BIT_OP;
+	buf[1] = i - USB20_CMD_HEADER;
+	buf[2] = 0;
+
+	return i;
+}
+
+static int ch34x_jtag_build_exit(struct ch34x_jtag_xfer *jx, u8 *buf)
+{
+	u8 trst = jx->trst;
+	int i = 0;
+
+	/* Exit1 -> Update -> Run-Test/Idle */
+	buf[i++] = USB20_CMD_JTAG_BIT_OP;
+	buf[i++] = 4;
+	buf[i++] = 0;
+	buf[i++] = JTAG_TMS_H | JTAG_TDI_H | JTAG_TCK_L | trst;
+	buf[i++] = JTAG_TMS_H | JTAG_TDI_H | JTAG_TCK_H | trst;
+	buf[i++] = JTAG_TMS_L | JTAG_TDI_H | JTAG_TCK_L | trst;
+	buf[i++] = JTAG_TMS_L | JTAG_TDI_H | JTAG_TCK_H | trst;
+
+	return i;
+}
+
+/*
+ * Fill @buf with at most @size bytes of shift commands, the response of
+ * one batch never exceeds the TDO buffer of the chip.
+ */
+static int ch34x_jtag_build(struct ch34x_jtag_xfer *jx, u8 *buf, int size)
+{
+	bool rd = jx->flags & CH34x_JTAG_READ;
+	u8 tms, tdi;
+	u8 tail;
+	int len = 0;
+	u32 n, i;
+
+	if (!jx->entered) {
+		if (jx->flags & (CH34x_JTAG_ENTER_DR | CH34x_JTAG_ENTER_IR))
+			len += ch34x_jtag_build_enter(jx, buf);
+		jx->entered = true;
+	}
+
+	while (jx->byte_pos < jx->fast_bytes &&
+	       size - len > USB20_CMD_HEADER) {
+		n = min_t(u32, jx->fast_bytes - jx->byte_pos,
+			  CH34X_JTAG_PKT_MAX);
+		n = min_t(u32, n, size - len - USB20_CMD_HEADER);
+		buf[len++] = rd ? USB20_CMD_JTAG_DATA_SHIFT_RD :
+				  USB20_CMD_JTAG_DATA_SHIFT;
+		buf[len++] = (u8)(n >> 0);
+		buf[len++] = (u8)(n >> 8);
+		if (copy_from_user(buf + len, jx->data + jx->byte_pos, n))
+			return -EFAULT;
+		len += n;
+		jx->byte_pos += n;
+		if (rd)
+			jx->rsp_bytes += USB20_CMD_HEADER + n;
+	}
+	if (jx->byte_pos < jx->fast_bytes)
+		return len;
+
+	if (!jx->tailed && jx->tail_bits) {
+		if (size - len < USB20_CMD_HEADER + jx->tail_bits * 2 + 1)
+			return len;
+		if (get_user(tail, (u8 __user *)jx->data + jx->fast_bytes))
+			return -EFAULT;
+		buf[len++] = rd ? USB20_CMD_JTAG_BIT_OP_RD :
+				  USB20_CMD_JTAG_BIT_OP;
+		buf[len++] = (u8)(jx->tail_bits * 2 + 1);
+		buf[len++] = 0;
+		if (rd)
+			jx->rsp_bytes += USB20_CMD_HEADER + jx->tail_bits;
+		tms = JTAG_TMS_L;
+		for (i = 0; i < jx->tail_bits; i++) {
+			tdi = (tail >> i) & 0x01 ? JTAG_TDI_H : JTAG_TDI_L;
+			/* the last bit is shifted on the way to Exit1 */
+			if (i + 1 == jx->tail_bits &&
+			    (jx->flags & CH34x_JTAG_EXIT_IDLE))
+				tms = JTAG_TMS_H;
+			buf[len++] = tms | tdi | JTAG_TCK_L | jx->trst;
+			buf[len++] = tms | tdi | JTAG_TCK_H | jx->trst;
+		}
+		/* leave TCK low, the response still has one byte per bit */
+		buf[len++] = tms | tdi | JTAG_TCK_L | jx->trst;
+	}
+	jx->tailed = true;
+
+	if (!jx->exited && (jx->flags & CH34x_JTAG_EXIT_IDLE)) {
+		if (size - len < USB20_CMD_HEADER + 4)
+			return len;
+		len += ch34x_jtag_build_exit(jx, buf + len);
+	}
+	jx->exited = true;
+
+	return len;
+}
+
+static bool ch34x_jtag_built(struct ch34x_jtag_xfer *jx)
+{
+	return jx->entered && jx->tailed && jx->exited;
+}
+
+/* sink of ch34x_cmd_parser, collect TDO bits to user space */
+static int ch34x_jtag_sink(void *context, u8 cmd, const u8 *data, u32 len)
+{
+	struct ch34x_jtag_xfer *jx = context;
+	u8 __user *tdo;
+	u32 i;
+
+	if (cmd == USB20_CMD_JTAG_DATA_SHIFT_RD) {
+		if ((jx->tdo_bits & 7) || len * 8 > jx->bits - jx->tdo_bits)
+			return -EPROTO;
+		if (copy_to_user(jx->data + jx->tdo_bits / 8, data, len))
+			return -EFAULT;
+		jx->tdo_bits += len * 8;
+		return 0;
+	}
+
+	/* USB20_CMD_JTAG_BIT_OP_RD returns one byte per bit */
+	if (len > jx->bits - jx->tdo_bits)
+		return -EPROTO;
+	for (i = 0; i < len; i++) {
+		if (data[i] & 0x01)
+			jx->tdo_acc |= BIT(jx->tdo_bits & 7);
+		jx->tdo_bits++;
+		if (!(jx->tdo_bits & 7) || jx->tdo_bits == jx->bits) {
+			tdo = (u8 __user *)jx->data + (jx->tdo_bits - 1) / 8;
+			if (put_user(jx->tdo_acc, tdo))
+				return -EFAULT;
+			jx->tdo_acc = 0;
+		}
+	}
+
+	return 0;
+}
+
+struct ch34x_jtag_urb {
+	struct urb *urb;
+	unsigned char *buf;
+	struct completion done;
+	wait_queue_head_t *wait;
+	bool busy;
+};
+
+static void ch34x_jtag_callback(struct urb *urb)
+{
+	struct ch34x_jtag_urb *ju = urb->context;
+
+	complete(&ju->done);
+	wake_up(ju->wait);
+}
+
+static int ch34x_jtag_urbs_alloc(struct ch34x_pis *ch34x_dev,
+				 struct ch34x_jtag_urb *ju, int nr,
+				 size_t size, wait_queue_head_t *wait)
+{
+	int i;
+
+	for (i = 0; i < nr; i++) {
+		ju[i].urb = usb_alloc_urb(0, GFP_KERNEL);
+		if (!ju[i].urb)
+			return -ENOMEM;
+		ju[i].buf = usb_alloc_coherent(ch34x_dev->udev, size,
+					       GFP_KERNEL,
+					       &ju[i].urb->transfer_dma);
+		if (!ju[i].buf)
+			return -ENOMEM;
+		ju[i].urb->transfer_flags |= URB_NO_TRANSFER_DMA_MAP;
+		init_completion(&ju[i].done);
+		ju[i].wait = wait;
+	}
+
+	return 0;
+}
+
+static void ch34x_jtag_urbs_free(struct ch34x_pis *ch34x_dev,
+				 struct ch34x_jtag_urb *ju, int nr,
+				 size_t size)
+{
+	int i;
+
+	for (i = 0; i < nr; i++) {
+		if (ju[i].buf)
+			usb_free_coherent(ch34x_dev->udev, size, ju[i].buf,
+					  ju[i].urb->transfer_dma);
+		usb_free_urb(ju[i].urb);
+	}
+}
+
+static int ch34x_jtag_submit(struct ch34x_pis *ch34x_dev,
+			     struct ch34x_jtag_urb *ju, unsigned int pipe,
+			     int len)
+{
+	int retval;
+
+	usb_fill_bulk_urb(ju->urb, ch34x_dev->udev, pipe, ju->buf, len,
+			  ch34x_jtag_callback, ju);
+	reinit_completion(&ju->done);
+	ju->busy = true;
+	retval = usb_submit_urb(ju->urb, GFP_KERNEL);
+	if (retval)
+		ju->busy = false;
+
+	return retval;
+}
+
+/*
+ * JTAG shift operation for ch347 mode3/ch347f, build the shift packets
+ * of @bits bits at @iobuffer in kernel, keep CH34X_JTAG_OUT_URBS batches
+ * in flight and return the TDO bits in place while CH34x_JTAG_READ set.
+ */
+static int ch34x_jtag_shift(struct ch34x_pis *ch34x_dev, void *iobuffer,
+			    u32 bits, u32 flags)
+{
+	DECLARE_WAIT_QUEUE_HEAD_ONSTACK(wait);
+	struct ch34x_jtag_urb out[CH34X_JTAG_OUT_URBS] = {};
+	struct ch34x_jtag_urb in[CH34X_BLKRD_URBS] = {};
+	struct ch34x_jtag_xfer jx = {
+		.data = (char __user *)iobuffer,
+		.bits = bits,
+		.flags = flags,
+		.trst = (flags & CH34x_JTAG_TRST_LOW) ? 0 : JTAG_TRST_H,
+	};
+	struct ch34x_cmd_parser parser;
+	size_t insize = ch34x_dev->bulk_in_size;
+	bool rd = flags & CH34x_JTAG_READ;
+	unsigned int outpipe, inpipe;
+	int in_cur = 0, in_next = 0, out_cur = 0, out_next = 0;
+	u32 in_done = 0, in_busy = 0, size;
+	int lane_len;
+	u8 *batch;
+	long timeleft, timeout;
+	int retval;
+	int i, len;
+
+	/* CH347T only exposes JTAG in mode 3 */
+	if (ch34x_dev->chiptype == CHIP_CH347T) {
+		if (ch34x_dev->ch34x_id[1] != CH347T_JTAG_PID)
+			return -EOPNOTSUPP;
+	} else if (ch34x_dev->chiptype != CHIP_CH347F) {
+		return -EOPNOTSUPP;
+	}
+
+	if (bits == 0 || bits > CH34X_JTAG_MAX_BITS ||
+	    ((flags & CH34x_JTAG_ENTER_DR) && (flags & CH34x_JTAG_ENTER_IR)))
+		return -EINVAL;
+
+	timeout = ch34x_dev->readtimeout ?
+			  msecs_to_jiffies(ch34x_dev->readtimeout) :
+			  MAX_SCHEDULE_TIMEOUT;
+
+	if ((flags & CH34x_JTAG_EXIT_IDLE) && !(bits & 7)) {
+		jx.fast_bytes = bits / 8 - 1;
+		jx.tail_bits = 8;
+	} else {
+		jx.fast_bytes = bits / 8;
+		jx.tail_bits = bits & 7;
+	}
+
+	spin_lock_irq(&ch34x_dev->err_lock);
+	retval = ch34x_dev->errors;
+	if (retval < 0) {
+		ch34x_dev->errors = 0;
+		retval = (retval == -EPIPE) ? retval : -EIO;
+	}
+	spin_unlock_irq(&ch34x_dev->err_lock);
+	if (retval < 0)
+		return retval;
+
+	retval = ch34x_jtag_urbs_alloc(ch34x_dev, out, CH34X_JTAG_OUT_URBS,
+				       CH34X_JTAG_BATCH, &wait);
+	if (retval)
+		goto error;
+	if (rd) {
+		retval = ch34x_jtag_urbs_alloc(ch34x_dev, in,
+					       CH34X_BLKRD_URBS, insize,
+					       &wait);
+		if (retval)
+			goto error;
+	}
+
+	ch34x_cmd_parser_init(&parser, USB20_CMD_JTAG_DATA_SHIFT_RD,
+			      USB20_CMD_JTAG_BIT_OP_RD, false, ch34x_jtag_sink,
+			      &jx);
+	parser.lane_dev = ch34x_dev;
+
+	mutex_lock(&ch34x_dev->io_mutex);
+	if (!ch34x_dev->interface) {
+		retval = -ENODEV;
+		goto error_kill;
+	}
+
+	outpipe = usb_sndbulkpipe(ch34x_dev->udev,
+				  ch34x_dev->bulk_out_endpointAddr);
+	inpipe = usb_rcvbulkpipe(ch34x_dev->udev,
+				 ch34x_dev->bulk_in_endpointAddr);
+
+	/* responses of short commands can only be picked up when reading */
+	if (rd)
+		ch34x_lane_open(ch34x_dev);
+
+	for (;;) {
+		/* top up the out window with freshly built batches */
+		while (!ch34x_jtag_built(&jx) && !out[out_next].busy) {
+			/* short commands of other threads lead the batch */
+			batch = out[out_next].buf;
+			lane_len = 0;
+			size = 0;
+			if (rd)
+				lane_len = ch34x_lane_take(ch34x_dev, batch,
+							   CH347_PACKET_LENGTH,
+							   &size);
+			jx.rsp_bytes += size;
+			len = CH34X_JTAG_BATCH - lane_len - size;
+			len = ch34x_jtag_build(&jx, batch + lane_len, len);
+			if (len < 0) {
+				retval = len;
+				goto error_kill;
+			}
+			len += lane_len;
+			if (!len)
+				continue;
+			retval = ch34x_jtag_submit(ch34x_dev, &out[out_next],
+						   outpipe, len);
+			if (retval)
+				goto error_kill;
+			out_next = (out_next + 1) % CH34X_JTAG_OUT_URBS;
+		}
+
+		/*
+		 * in urbs are one packet long, a response ending on a packet
+		 * boundary completes its last urb without a short packet or
+		 * zero length packet behind it
+		 */
+		while (rd && !in[in_next].busy &&
+		       in_done + in_busy < jx.rsp_bytes) {
+			retval = ch34x_jtag_submit(ch34x_dev, &in[in_next],
+						   inpipe, insize);
+			if (retval)
+				goto error_kill;
+			in_busy++;
+			in_next = (in_next + 1) % CH34X_BLKRD_URBS;
+		}
+
+		if (ch34x_jtag_built(&jx) && !out[out_cur].busy &&
+		    (!rd || (jx.tdo_bits >= bits && in_done >= jx.rsp_bytes)))
+			break;
+
+		timeleft = wait_event_interruptible_timeout(
+			wait,
+			(out[out_cur].busy &&
+			 completion_done(&out[out_cur].done)) ||
+				(in[in_cur].busy &&
+				 completion_done(&in[in_cur].done)),
+			timeout);
+		if (timeleft <= 0) {
+			retval = timeleft ? timeleft : -ETIMEDOUT;
+			goto error_kill;
+		}
+
+		/* out and in urbs complete in submission order */
+		while (out[out_cur].busy &&
+		       completion_done(&out[out_cur].done)) {
+			out[out_cur].busy = false;
+			retval = out[out_cur].urb->status;
+			if (retval)
+				goto error_status;
+			out_cur = (out_cur + 1) % CH34X_JTAG_OUT_URBS;
+		}
+
+		while (in[in_cur].busy && completion_done(&in[in_cur].done)) {
+			in[in_cur].busy = false;
+			retval = in[in_cur].urb->status;
+			if (retval)
+				goto error_status;
+			in_busy--;
+			in_done += in[in_cur].urb->actual_length;
+			retval = ch34x_cmd_parser_feed(
+				&parser, in[in_cur].buf,
+				in[in_cur].urb->actual_length);
+			if (retval)
+				goto error_kill;
+			in_cur = (in_cur + 1) % CH34X_BLKRD_URBS;
+		}
+	}
+	retval = 0;
+	goto error_kill;
+
+error_status:
+	if (retval == -EPIPE) {
+		spin_lock_irq(&ch34x_dev->err_lock);
+		ch34x_dev->errors = retval;
+		spin_unlock_irq(&ch34x_dev->err_lock);
+		/* either direction may have stalled */
+		ch34x_halt_schedule(ch34x_dev, CH34X_HALT_OUT);
+		ch34x_halt_schedule(ch34x_dev, CH34X_HALT_IN);
+	}
+error_kill:
+	ch34x_lane_close(ch34x_dev);
+	for (i = 0; i < CH34X_JTAG_OUT_URBS; i++)
+		usb_kill_urb(out[i].urb);
+	for (i = 0; rd && i < CH34X_BLKRD_URBS; i++)
+		usb_kill_urb(in[i].urb);
+	mutex_unlock(&ch34x_dev->io_mutex);
+error:
+	ch34x_jtag_urbs_free(ch34x_dev, out, CH34X_JTAG_OUT_URBS,
+			     CH34X_JTAG_BATCH);
+	ch34x_jtag_urbs_free(ch34x_dev, in, CH34X_BLKRD_URBS, insize);
+
+	return retval == 0 ? (rd ? jx.tdo_bits : bits) : retval;
+}
+
+/*
+ * Arm the upload urbs. The pm reference is held until the upload stops,
+ * so the device does not autosuspend under a running stream.
+ */
+static int ch34x_start_read_io(struct ch34x_pis *ch34x_dev)
+{
+	int retval = -ENODEV;
+	int i;
+
+	mutex_lock(&ch34x_dev->io_mutex);
+	if (ch34x_dev->interface == NULL)
+		goto disconnected;
+
+	retval = 0;
+	if (ch34x_dev->buffered_mode)
+		goto disconnected;
+
+	retval = usb_autopm_get_interface(ch34x_dev->interface);
+	if (retval)
+		goto error_get_interface;
+
+	retval = ch34x_submit_read_urbs(ch34x_dev, GFP_KERNEL);
+	if (retval)
+		goto error_submit_read_urbs;
+
+	ch34x_dev->buffered_mode = true;
+	mutex_unlock(&ch34x_dev->io_mutex);
+
+	return 0;
+
+error_submit_read_urbs:
+	for (i = 0; i < ch34x_dev->rx_buflimit; i++)
+		usb_kill_urb(ch34x_dev->read_urbs[i]);
+	usb_autopm_put_interface(ch34x_dev->interface);
+error_get_interface:
+disconnected:
+	mutex_unlock(&ch34x_dev->io_mutex);
+	return usb_translate_errors(retval);
+}
+
+/* kill the upload urbs and drop their pm reference, io_mutex is held */
+static void ch34x_rx_stop(struct ch34x_pis *ch34x_dev)
+{
+	int i;
+
+	if (!ch34x_dev->buffered_mode)
+		return;
+
+	for (i = 0; i < ch34x_dev->rx_buflimit; i++)
+		usb_kill_urb(ch34x_dev->read_urbs[i]);
+	ch34x_dev->buffered_mode = false;
+
+	/* after disconnect usbcore has dropped our references */
+	if (ch34x_dev->interface)
+		usb_autopm_put_interface(ch34x_dev->interface);
+}
+
+static int ch34x_stop_read_io(struct ch34x_pis *ch34x_dev)
+{
+	mutex_lock(&ch34x_dev->io_mutex);
+	if (ch34x_dev->interface == NULL) {
+		mutex_unlock(&ch34x_dev->io_mutex);
+		return -ENODEV;
+	}
+	ch34x_rx_stop(ch34x_dev);
+	mutex_unlock(&ch34x_dev->io_mutex);
+
+	return 0;
+}
+
+/* the rx fifo is fed by the buffered upload or by a stream */
+static bool ch34x_rx_active(struct ch34x_pis *ch34x_dev)
+{
+	return ch34x_dev->buffered_mode || ch34x_stream_active(ch34x_dev);
+}
+
+static u32 ch34x_query_slave_fifo(struct ch34x_pis *ch34x_dev)
+{
+	unsigned long flags;
+	u32 fifolen;
+
+	spin_lock_irqsave(&ch34x_dev->read_lock, flags);
+	fifolen = kfifo_len(&ch34x_dev->rfifo);
+	spin_unlock_irqrestore(&ch34x_dev->read_lock, flags);
+
+	return fifolen;
+}
+
+static void ch34x_reset_slave_fifo(struct ch34x_pis *ch34x_dev)
+{
+	unsigned long flags;
+
+	mutex_lock(&ch34x_dev->rfifo_mutex);
+	spin_lock_irqsave(&ch34x_dev->read_lock, flags);
+	kfifo_reset(&ch34x_dev->rfifo);
+	spin_unlock_irqrestore(&ch34x_dev->read_lock, flags);
+	mutex_unlock(&ch34x_dev->rfifo_mutex);
+}
+
+static void ch34x_mem_cmd_callback(struct urb *urb)
+{
+	struct ch34x_pis *ch34x_dev = urb->context;
+
+	if (urb->status == -EPIPE)
+		ch34x_halt_schedule(ch34x_dev, CH34X_HALT_OUT);
+}
+
+/* the in urb first, so the answer always finds it waiting */
+static int ch34x_mem_submit_slot(struct ch34x_pis *ch34x_dev, int i,
+				 gfp_t mem_flags)
+{
+	struct ch34x_mem_stream *ms = &ch34x_dev->mem;
+	int retval;
+
+	retval = usb_submit_urb(ms->in_urbs[i], mem_flags);
+	if (retval)
+		return retval;
+	retval = usb_submit_urb(ms->cmd_urbs[i], mem_flags);
+	if (retval)
+		usb_unlink_urb(ms->in_urbs[i]);
+
+	return retval;
+}
+
+static void ch34x_mem_in_callback(struct urb *urb)
+{
+	struct ch34x_pis *ch34x_dev = urb->context;
+	struct ch34x_mem_stream *ms = &ch34x_dev->mem;
+	unsigned long flags;
+	bool room;
+	int i;
+
+	switch (urb->status) {
+	case 0:
+		break;
+	case -ENOENT:
+	case -ECONNRESET:
+	case -ESHUTDOWN:
+		return;
+	default:
+		/* the reader sees the error, the slot stays idle */
+		spin_lock_irqsave(&ch34x_dev->err_lock, flags);
+		ch34x_dev->errors = urb->status;
+		spin_unlock_irqrestore(&ch34x_dev->err_lock, flags);
+		if (urb->status == -EPIPE)
+			ch34x_halt_schedule(ch34x_dev, CH34X_HALT_IN);
+		wake_up_interruptible(&ch34x_dev->wait);
+		return;
+	}
+
+	for (i = 0; i < CH34X_EPP_URBS - 1; i++) {
+		if (ms->in_urbs[i] == urb)
+			break;
+	}
+
+	/* room for every slot, so a resubmitted one never overflows */
+	spin_lock_irqsave(&ch34x_dev->read_lock, flags);
+	kfifo_in(&ch34x_dev->rfifo, urb->transfer_buffer, urb->actual_length);
+	ch34x_dev->rx_bytes += urb->actual_length;
+	room = kfifo_avail(&ch34x_dev->rfifo) >=
+	       ms->chunk * CH34X_EPP_URBS;
+	if (!room)
+		set_bit(i, &ms->parked);
+	spin_unlock_irqrestore(&ch34x_dev->read_lock, flags);
+
+	ch34x_dev->rx_flag = true;
+	wake_up_interruptible(&ch34x_dev->wait);
+
+	if (room && ch34x_mem_submit_slot(ch34x_dev, i, GFP_ATOMIC))
+		dev_dbg(&urb->dev->dev, "%s - slot %d stopped\n", __func__, i);
+}
+
+/* give the parked slots back to the stream once the reader made room */
+static void ch34x_mem_refill(struct ch34x_pis *ch34x_dev, gfp_t mem_flags)
+{
+	struct ch34x_mem_stream *ms = &ch34x_dev->mem;
+	unsigned long flags;
+	int i;
+
+	while (ms->running) {
+		spin_lock_irqsave(&ch34x_dev->read_lock, flags);
+		i = -1;
+		if (ms->parked && kfifo_avail(&ch34x_dev->rfifo) >=
+					  ms->chunk * CH34X_EPP_URBS) {
+			i = find_first_bit(&ms->parked, CH34X_EPP_URBS);
+			clear_bit(i, &ms->parked);
+		}
+		spin_unlock_irqrestore(&ch34x_dev->read_lock, flags);
+		if (i < 0 || ch34x_mem_submit_slot(ch34x_dev, i, mem_flags))
+			break;
+	}
+}
+
+/*
+ * Keep CH34X_EPP_URBS reads of @chunk bytes in flight in the current read
+ * mode until stopped. The data is drained from the rx fifo like the slave
+ * fifo of ch346c, the stream waits for the reader instead of dropping.
+ */
+static int ch34x_start_mem_stream(struct ch34x_pis *ch34x_dev, u32 chunk)
+{
+	struct ch34x_mem_stream *ms = &ch34x_dev->mem;
+	struct usb_device *udev = ch34x_dev->udev;
+	u32 step = ch34x_epp_read_step(ch34x_dev);
+	unsigned int inpipe, outpipe;
+	int retval = -ENODEV;
+	int i;
+
+	if (ch34x_dev->chiptype != CHIP_CH341)
+		return -EOPNOTSUPP;
+	if (!chunk)
+		chunk = step;
+	if (chunk > step)
+		return -EINVAL;
+
+	mutex_lock(&ch34x_dev->io_mutex);
+	if (ch34x_dev->interface == NULL)
+		goto error;
+
+	retval = -EBUSY;
+	if (ch34x_stream_active(ch34x_dev))
+		goto error;
+
+	retval = -ENOMEM;
+	if (!ms->cmd) {
+		ms->cmd = kmalloc(CH34X_EPP_URBS * 2, GFP_KERNEL);
+		if (!ms->cmd)
+			goto error;
+	}
+	for (i = 0; i < CH34X_EPP_URBS; i++) {
+		if (!ms->in_urbs[i])
+			ms->in_urbs[i] = usb_alloc_urb(0, GFP_KERNEL);
+		if (!ms->cmd_urbs[i])
+			ms->cmd_urbs[i] = usb_alloc_urb(0, GFP_KERNEL);
+		if (!ms->bufs[i])
+			ms->bufs[i] = kmalloc(CH341_EPP_IO_MAX, GFP_KERNEL);
+		if (!ms->in_urbs[i] || !ms->cmd_urbs[i] || !ms->bufs[i])
+			goto error;
+	}
+	if (!kfifo_initialized(&ch34x_dev->rfifo) &&
+	    kfifo_alloc(&ch34x_dev->rfifo, CH34X_RX_FIFO_LENGTH, GFP_KERNEL))
+		goto error;
+
+	inpipe = usb_rcvbulkpipe(udev, ch34x_dev->bulk_in_endpointAddr);
+	outpipe = usb_sndbulkpipe(udev, ch34x_dev->bulk_out_endpointAddr);
+	for (i = 0; i < CH34X_EPP_URBS; i++) {
+		ms->cmd[i * 2] = ch34x_dev->para_rmode;
+		ms->cmd[i * 2 + 1] = chunk;
+		usb_fill_bulk_urb(ms->cmd_urbs[i], udev, outpipe,
+				  ms->cmd + i * 2, 2, ch34x_mem_cmd_callback,
+				  ch34x_dev);
+		usb_fill_bulk_urb(ms->in_urbs[i], udev, inpipe, ms->bufs[i],
+				  chunk, ch34x_mem_in_callback, ch34x_dev);
+		usb_unpoison_urb(ms->in_urbs[i]);
+		usb_unpoison_urb(ms->cmd_urbs[i]);
+	}
+
+	retval = usb_autopm_get_interface(ch34x_dev->interface);
+	if (retval)
+		goto error;
+
+	ch34x_reset_slave_fifo(ch34x_dev);
+	ms->chunk = chunk;
+	ms->parked = 0;
+	ms->running = true;
+	for (i = 0; i < CH34X_EPP_URBS; i++) {
+		retval = ch34x_mem_submit_slot(ch34x_dev, i, GFP_KERNEL);
+		if (retval) {
+			ch34x_mem_stop(ch34x_dev);
+			goto error;
+		}
+	}
+	mutex_unlock(&ch34x_dev->io_mutex);
+
+	return 0;
+
+error:
+	mutex_unlock(&ch34x_dev->io_mutex);
+	return usb_translate_errors(retval);
+}
+
+/* stop the slots and drop the pm reference, io_mutex is held */
+static void ch34x_mem_stop(struct ch34x_pis *ch34x_dev)
+{
+	struct ch34x_mem_stream *ms = &ch34x_dev->mem;
+	int i;
+
+	if (!ms->running)
+		return;
+
+	/* a reader may refill concurrently, poisoned urbs refuse it */
+	for (i = 0; i < CH34X_EPP_URBS; i++) {
+		usb_poison_urb(ms->in_urbs[i]);
+		usb_poison_urb(ms->cmd_urbs[i]);
+	}
+	ms->running = false;
+
+	if (ch34x_dev->interface)
+		usb_autopm_put_interface(ch34x_dev->interface);
+}
+
+static int ch34x_stop_mem_stream(struct ch34x_pis *ch34x_dev)
+{
+	mutex_lock(&ch34x_dev->io_mutex);
+	if (ch34x_dev->interface == NULL) {
+		mutex_unlock(&ch34x_dev->io_mutex);
+		return -ENODEV;
+	}
+	ch34x_mem_stop(ch34x_dev);
+	mutex_unlock(&ch34x_dev->io_mutex);
+
+	return 0;
+}
+
+static int ch34x_slave_fifo_read(struct ch34x_pis *ch34x_dev,
+				 void *obuffer, u32 bytes_to_read,
+				 int readtimeout)
+{
+	int bytes_read;
+	unsigned char *obuf;
+	int retval = 0;
+	int fifolen;
+	unsigned long flags;
+
+	if ((bytes_to_read > CH346_KFIFO_LENGTH) || (bytes_to_read == 0)) {
+		retval = -EINVAL;
+		goto exit;
+	}
+
+	spin_lock_irq(&ch34x_dev->err_lock);
+	retval = ch34x_dev->errors;
+	if (retval < 0) {
+		ch34x_dev->errors = 0;
+		retval = (retval == -EPIPE) ? retval : -EIO;
+	}
+	spin_unlock_irq(&ch34x_dev->err_lock);
+	if (retval < 0)
+		goto exit;
+
+	ch34x_mem_refill(ch34x_dev, GFP_KERNEL);
+	spin_lock_irqsave(&ch34x_dev->read_lock, flags);
+	fifolen = kfifo_len(&ch34x_dev->rfifo);
+	spin_unlock_irqrestore(&ch34x_dev->read_lock, flags);
+
+	if (fifolen == 0) {
+		retval = wait_event_interruptible_timeout(
+			ch34x_dev->wait,
+			ch34x_dev->rx_flag ||
+				(ch34x_dev->interface == NULL),
+			msecs_to_jiffies(readtimeout));
+		if (retval <= 0)
+			return retval;
+	}
+
+	bytes_read = bytes_to_read > fifolen ? fifolen : bytes_to_read;
+
+	obuf = (char *)kmalloc(sizeof(unsigned char) * bytes_to_read,
+			       GFP_KERNEL);
+	if (!obuf) {
+		retval = -ENOMEM;
+		goto error;
+	}
+
+	mutex_lock(&ch34x_dev->rfifo_mutex);
+	spin_lock_irqsave(&ch34x_dev->read_lock, flags);
+	retval = kfifo_out(&ch34x_dev->rfifo, obuf, bytes_read);
+	spin_unlock_irqrestore(&ch34x_dev->read_lock, flags);
+	mutex_unlock(&ch34x_dev->rfifo_mutex);
+	if (retval != bytes_read) {
+		retval = -EFAULT;
+		goto error;
+	}
+	ch34x_mem_refill(ch34x_dev, GFP_KERNEL);
+
+	retval = copy_to_user((char __user *)obuffer, obuf, bytes_read);
+	if (retval)
+		retval = -ENOMEM;
+
+error:
+	if (obuf)
+		kfree(obuf);
+exit:
+	return retval == 0 ? bytes_read : retval;
+}
+
+#if (LINUX_VERSION_CODE >= KERNEL_VERSION(4, 9, 0))
+/*
+ * Read operation for the slave fifo of ch346c, used by splice() so the
+ * received data goes from the fifo to the pipe pages without passing
+ * through user space.  Before 4.9 splice went through the page cache
+ * and never reached read_iter.
+ */
+static ssize_t ch34x_fops_read_iter(struct kiocb *iocb, struct iov_iter *to)
+{
+	struct file *file = iocb->ki_filp;
+	struct ch34x_file *cfile = file->private_data;
+	struct ch34x_pis *ch34x_dev = cfile->ch34x_dev;
+	struct __kfifo *fifo = &ch34x_dev->rfifo.kfifo;
+	unsigned long flags;
+	unsigned int fifolen, off, len;
+	size_t copied, total = 0;
+	int retval;
+
+	if (ch34x_dev->chiptype != CHIP_CH346C &&
+	    !ch34x_stream_active(ch34x_dev))
+		return -EINVAL;
+	if (!ch34x_rx_active(ch34x_dev))
+		return -EINPROGRESS;
+	if (!ch34x_fifo_owned(cfile, true))
+		return -EBUSY;
+
+	spin_lock_irq(&ch34x_dev->err_lock);
+	retval = ch34x_dev->errors;
+	if (retval < 0) {
+		ch34x_dev->errors = 0;
+		retval = (retval == -EPIPE) ? retval : -EIO;
+	}
+	spin_unlock_irq(&ch34x_dev->err_lock);
+	if (retval < 0)
+		return retval;
+
+	ch34x_mem_refill(ch34x_dev, GFP_KERNEL);
+	if (ch34x_query_slave_fifo(ch34x_dev) == 0) {
+		if (file->f_flags & O_NONBLOCK)
+			return -EAGAIN;
+#if (LINUX_VERSION_CODE >= KERNEL_VERSION(4, 13, 0))
+		if (iocb->ki_flags & IOCB_NOWAIT)
+			return -EAGAIN;
+#endif
+		retval = wait_event_interruptible(
+			ch34x_dev->wait,
+			ch34x_query_slave_fifo(ch34x_dev) ||
+				(ch34x_dev->interface == NULL));
+		if (retval)
+			return retval;
+		if (ch34x_dev->interface == NULL)
+			return -ENODEV;
+	}
+
+	/*
+	 * The completion handler only appends to the fifo, so the used part
+	 * can be copied out without the lock and released afterwards.  Other
+	 * readers and resets are kept out by rfifo_mutex.
+	 */
+	mutex_lock(&ch34x_dev->rfifo_mutex);
+	while (iov_iter_count(to)) {
+		spin_lock_irqsave(&ch34x_dev->read_lock, flags);
+		fifolen = kfifo_len(&ch34x_dev->rfifo);
+		off = fifo->out & fifo->mask;
+		spin_unlock_irqrestore(&ch34x_dev->read_lock, flags);
+		if (!fifolen)
+			break;
+
+		len = min_t(unsigned int, fifolen, fifo->mask + 1 - off);
+		len = min_t(size_t, len, iov_iter_count(to));
+		copied = copy_to_iter((u8 *)fifo->data + off, len, to);
+
+		spin_lock_irqsave(&ch34x_dev->read_lock, flags);
+		fifo->out += copied;
+		spin_unlock_irqrestore(&ch34x_dev->read_lock, flags);
+
+		total += copied;
+		if (copied < len)
+			break;
+	}
+	mutex_unlock(&ch34x_dev->rfifo_mutex);
+	ch34x_mem_refill(ch34x_dev, GFP_KERNEL);
+
+	return total ? total : -EFAULT;
+}
+#endif
+
+static u32 ch34x_txring_free_slots(struct ch34x_txring *ring)
+{
+	unsigned long flags;
+	u32 tail;
+
+	spin_lock_irqsave(&ring->lock, flags);
+	tail = ring->tail;
+	spin_unlock_irqrestore(&ring->lock, flags);
+
+	return ring->slot_count - (ring->head - tail);
+}
+
+static void ch34x_txring_callback(struct urb *urb)
+{
+	struct ch34x_txring *ring = urb->context;
+	struct ch34x_pis *ch34x_dev = ring->ch34x_dev;
+	ktime_t start = ktime_get();
+	unsigned long flags;
+
+	ch34x_write_bulk_status(ch34x_dev, urb);
+
+	/* completions of one endpoint come back in submission order */
+	spin_lock_irqsave(&ring->lock, flags);
+	ring->tail++;
+	spin_unlock_irqrestore(&ring->lock, flags);
+
+	wake_up_interruptible(&ring->wait);
+	ch34x_write_bulk_account(ch34x_dev, urb, start);
+}
+
+static void ch34x_txring_free(struct ch34x_pis *ch34x_dev,
+			      struct ch34x_txring *ring)
+{
+	int i;
+
+	if (!ring)
+		return;
+
+	usb_kill_anchored_urbs(&ring->submitted);
+	for (i = 0; i < ring->slot_count; i++)
+		usb_free_urb(ring->urbs[i]);
+	if (ring->base)
+		usb_free_coherent(ch34x_dev->udev, ring->size, ring->base,
+				  ring->dma);
+	kfree(ring);
+}
+
+/*
+ * Allocate a ring of @slot_count slots of @slot_size bytes each, or
+ * release the current one when @slot_count is 0.
+ */
+static int ch34x_txring_setup(struct ch34x_file *cfile, u32 slot_size,
+			      u32 slot_count)
+{
+	struct ch34x_pis *ch34x_dev = cfile->ch34x_dev;
+	struct ch34x_txring *ring = cfile->txring;
+	u32 maxlen = ch34x_dev->chiptype == CHIP_CH346C ?
+			     MAX_SLAVE_LENGTH :
+			     MAX_BUFFER_LENGTH;
+	int retval = 0;
+	int i;
+
+	if (ring) {
+		if (slot_count || atomic_read(&ring->mapped))
+			return -EBUSY;
+		cfile->txring = NULL;
+		ch34x_txring_free(ch34x_dev, ring);
+		return 0;
+	}
+
+	if (!slot_count)
+		return 0;
+	if (slot_count > CH34X_TXRING_SLOTS_MAX || slot_size == 0 ||
+	    slot_size > maxlen ||
+	    (u64)slot_size * slot_count > CH34X_TXRING_MAX_LENGTH)
+		return -EINVAL;
+
+	ring = kzalloc(sizeof(struct ch34x_txring), GFP_KERNEL);
+	if (!ring)
+		return -ENOMEM;
+
+	ring->ch34x_dev = ch34x_dev;
+	ring->slot_size = slot_size;
+	ring->slot_count = slot_count;
+	ring->size = PAGE_ALIGN((size_t)slot_size * slot_count);
+	atomic_set(&ring->mapped, 0);
+	init_usb_anchor(&ring->submitted);
+	init_waitqueue_head(&ring->wait);
+	spin_lock_init(&ring->lock);
+
+	ring->base = usb_alloc_coherent(ch34x_dev->udev, ring->size,
+					GFP_KERNEL | __GFP_ZERO, &ring->dma);
+	if (!ring->base) {
+		retval = -ENOMEM;
+		goto error;
+	}
+
+	for (i = 0; i < slot_count; i++) {
+		ring->urbs[i] = usb_alloc_urb(0, GFP_KERNEL);
+		if (!ring->urbs[i]) {
+			retval = -ENOMEM;
+			goto error;
+		}
+	}
+
+	cfile->txring = ring;
+
+	return 0;
+
+error:
+	ch34x_txring_free(ch34x_dev, ring);
+	return retval;
+}
+
+/*
+ * Submit the next @nr slots of the ring, their lengths are read from
+ * @lens. Then wait until at least @wait_free slots are free again.
+ * Returns the number of slots submitted, and the free slot count in
+ * @free_slots.
+ */
+static int ch34x_txring_doorbell(struct ch34x_file *cfile, u32 nr,
+				 u32 wait_free, u32 __user *lens,
+				 u32 *free_slots)
+{
+	struct ch34x_pis *ch34x_dev = cfile->ch34x_dev;
+	struct ch34x_txring *ring;
+	struct urb *urb;
+	u32 len[CH34X_TXRING_SLOTS_MAX];
+	u32 submitted = 0;
+	u32 slot;
+	long timeout;
+	int retval;
+
+	/* fetch the lengths first, mmap() takes ring_mutex under mmap_lock */
+	nr = min_t(u32, nr, CH34X_TXRING_SLOTS_MAX);
+	if (copy_from_user(len, lens, nr * sizeof(u32)))
+		return -EFAULT;
+
+	spin_lock_irq(&ch34x_dev->err_lock);
+	retval = ch34x_dev->errors;
+	if (retval < 0) {
+		ch34x_dev->errors = 0;
+		retval = (retval == -EPIPE) ? retval : -EIO;
+	}
+	spin_unlock_irq(&ch34x_dev->err_lock);
+	if (retval < 0)
+		return retval;
+
+	if (ch34x_stream_active(ch34x_dev))
+		return -EBUSY;
+
+	mutex_lock(&cfile->ring_mutex);
+	ring = cfile->txring;
+	if (!ring) {
+		retval = -EINVAL;
+		goto exit;
+	}
+
+	mutex_lock(&ch34x_dev->io_mutex);
+	if (!ch34x_dev->interface) {
+		mutex_unlock(&ch34x_dev->io_mutex);
+		retval = -ENODEV;
+		goto exit;
+	}
+
+	/* free slots only grow meanwhile, the batch size is known up front */
+	nr = min(nr, ch34x_txring_free_slots(ring));
+	while (submitted < nr) {
+		if (len[submitted] == 0 || len[submitted] > ring->slot_size) {
+			retval = -EINVAL;
+			break;
+		}
+
+		slot = ring->head % ring->slot_count;
+		urb = ring->urbs[slot];
+		usb_fill_bulk_urb(
+			urb, ch34x_dev->udev,
+			usb_sndbulkpipe(ch34x_dev->udev,
+					ch34x_dev->bulk_out_endpointAddr),
+			ring->base + slot * ring->slot_size, len[submitted],
+			ch34x_txring_callback, ring);
+		urb->transfer_dma = ring->dma + slot * ring->slot_size;
+		urb->transfer_flags = URB_NO_TRANSFER_DMA_MAP;
+		if (submitted + 1 < nr &&
+		    (submitted + 1) % CH34X_TX_COALESCE)
+			urb->transfer_flags |= URB_NO_INTERRUPT;
+		usb_anchor_urb(urb, &ring->submitted);
+
+		retval = usb_submit_urb(urb, GFP_KERNEL);
+		if (retval) {
+			dev_err(&ch34x_dev->interface->dev,
+				"%s - failed submitting write urb, error %d\n",
+				__func__, retval);
+			usb_unanchor_urb(urb);
+			break;
+		}
+		ring->head++;
+		submitted++;
+	}
+	mutex_unlock(&ch34x_dev->io_mutex);
+	if (submitted)
+		retval = 0;
+	if (retval)
+		goto exit;
+
+	if (wait_free > ring->slot_count)
+		wait_free = ring->slot_count;
+	timeout = cfile->writetimeout ?
+			  msecs_to_jiffies(cfile->writetimeout) :
+			  MAX_SCHEDULE_TIMEOUT;
+	timeout = wait_event_interruptible_timeout(
+		ring->wait, ch34x_txring_free_slots(ring) >= wait_free,
+		timeout);
+	if (timeout < 0 && !submitted) {
+		retval = timeout;
+		goto exit;
+	}
+
+	*free_slots = ch34x_txring_free_slots(ring);
+	retval = submitted;
+
+exit:
+	mutex_unlock(&cfile->ring_mutex);
+	return retval;
+}
+
+static void ch34x_txring_vm_open(struct vm_area_struct *vma)
+{
+	struct ch34x_txring *ring = vma->vm_private_data;
+
+	atomic_inc(&ring->mapped);
+}
+
+static void ch34x_txring_vm_close(struct vm_area_struct *vma)
+{
+	struct ch34x_txring *ring = vma->vm_private_data;
+
+	atomic_dec(&ring->mapped);
+}
+
+static const struct vm_operations_struct ch34x_txring_vm_ops = {
+	.open = ch34x_txring_vm_open,
+	.close = ch34x_txring_vm_close,
+};
+
+/*
+ * Map the transmit ring into user space, the same way usbfs maps its
+ * coherent buffers.
+ */
+static int ch34x_fops_mmap(struct file *file, struct vm_area_struct *vma)
+{
+	struct ch34x_file *cfile = file->private_data;
+	struct ch34x_pis *ch34x_dev = cfile->ch34x_dev;
+	struct ch34x_txring *ring;
+	size_t size = vma->vm_end - vma->vm_start;
+	int retval;
+#if (LINUX_VERSION_CODE >= KERNEL_VERSION(5, 4, 0))
+	struct usb_hcd *hcd = bus_to_hcd(ch34x_dev->udev->bus);
+#endif
+
+	mutex_lock(&cfile->ring_mutex);
+	ring = cfile->txring;
+	if (!ring || vma->vm_pgoff || size > ring->size) {
+		retval = -EINVAL;
+		goto exit;
+	}
+
+#if (LINUX_VERSION_CODE >= KERNEL_VERSION(5, 4, 0))
+	if (hcd->localmem_pool || !hcd_uses_dma(hcd))
+		retval = remap_pfn_range(vma, vma->vm_start,
+					 virt_to_phys(ring->base) >>
+						 PAGE_SHIFT,
+					 size, vma->vm_page_prot);
+	else
+		retval = dma_mmap_coherent(hcd->self.sysdev, vma,
+					   ring->base, ring->dma, size);
+#else
+	retval = remap_pfn_range(vma, vma->vm_start,
+				 virt_to_phys(ring->base) >> PAGE_SHIFT, size,
+				 vma->vm_page_prot);
+#endif
+	if (retval)
+		goto exit;
+
+#if (LINUX_VERSION_CODE >= KERNEL_VERSION(6, 3, 0))
+	vm_flags_set(vma, VM_DONTEXPAND | VM_DONTDUMP);
+#else
+	vma->vm_flags |= VM_DONTEXPAND | VM_DONTDUMP;
+#endif
+	vma->vm_ops = &ch34x_txring_vm_ops;
+	vma->vm_private_data = ring;
+	ch34x_txring_vm_open(vma);
+
+exit:
+	mutex_unlock(&cfile->ring_mutex);
+	return retval;
+}
+
+/* arm the interrupt urb, it holds a pm reference like the upload */
+static int ch34x_start_irq_task(struct ch34x_pis *ch34x_dev)
+{
+	int retval = -ENODEV;
+	mutex_lock(&ch34x_dev->io_mutex);
+	if (ch34x_dev->interface == NULL)
+		goto error;
+
+	retval = 0;
+	if (ch34x_dev->irq_enable)
+		goto error;
+
+	retval = usb_autopm_get_interface(ch34x_dev->interface);
+	if (retval)
+		goto error;
+
+	retval = usb_submit_urb(ch34x_dev->interrupt_in_urb, GFP_KERNEL);
+	if (retval) {
+		usb_autopm_put_interface(ch34x_dev->interface);
+		goto error;
+	}
+
+	ch34x_dev->irq_enable = true;
+	mutex_unlock(&ch34x_dev->io_mutex);
+
+	return 0;
+
+error:
+	mutex_unlock(&ch34x_dev->io_mutex);
+	return usb_translate_errors(retval);
+}
+
+/* kill the interrupt urb and drop its pm reference, io_mutex is held */
+static void ch34x_irq_stop(struct ch34x_pis *ch34x_dev)
+{
+	if (!ch34x_dev->irq_enable)
+		return;
+
+	usb_kill_urb(ch34x_dev->interrupt_in_urb);
+	ch34x_dev->irq_enable = false;
+
+	if (ch34x_dev->interface)
+		usb_autopm_put_interface(ch34x_dev->interface);
+}
+
+static int ch34x_stop_irq_task(struct ch34x_pis *ch34x_dev)
+{
+	int retval = 0;
+
+	mutex_lock(&ch34x_dev->io_mutex);
+	if (ch34x_dev->interface == NULL) {
+		retval = -ENODEV;
+		goto exit;
+	}
+	/* an acquisition armed on a gpio would never fire, stop it first */
+	if (ch34x_dev->acq.running &&
+	    ch34x_dev->acq.trigger != CH34X_ACQ_TIMER) {
+		retval = -EBUSY;
+		goto exit;
+	}
+	ch34x_irq_stop(ch34x_dev);
+exit:
+	mutex_unlock(&ch34x_dev->io_mutex);
+
+	return retval;
+}
+
+static void ch34x_acq_out_callback(struct urb *urb)
+{
+	struct ch34x_pis *ch34x_dev = urb->context;
+
+	if (urb->status == -EPIPE)
+		ch34x_halt_schedule(ch34x_dev, CH34X_HALT_OUT);
+	atomic_dec(&ch34x_dev->acq.pending);
+}
+
+/* append the response to the rx fifo, whole records only */
+static void ch34x_acq_in_callback(struct urb *urb)
+{
+	struct ch34x_pis *ch34x_dev = urb->context;
+	struct ch34x_acq *acq = &ch34x_dev->acq;
+	struct ch34x_acq_rec rec;
 	unsigned long flags;
 
-	if ((bytes_to_read > CH346_KFIFO_LENGTH) || (bytes_to_read == 0)) {
-		retval = -EINVAL;
-		goto exit;
+	if (urb->status) {
+		if (urb->status == -EPIPE)
+			ch34x_halt_schedule(ch34x_dev, CH34X_HALT_IN);
+		goto out;
 	}
 
-	spin_lock_irq(&ch34x_dev->err_lock);
-	retval = ch34x_dev->errors;
-	if (retval < 0) {
-		ch34x_dev->errors = 0;
-		retval = (retval == -EPIPE) ? retval : -EIO;
-	}
-	spin_unlock_irq(&ch34x_dev->err_lock);
-	if (retval < 0)
-		goto exit;
+	rec.stamp_ns = ktime_to_ns(acq->stamp);
+	rec.seq = acq->seq;
+	rec.len = urb->actual_length;
 
 	spin_lock_irqsave(&ch34x_dev->read_lock, flags);
-	fifolen = kfifo_len(&ch34x_dev->rfifo);
+	if (kfifo_avail(&ch34x_dev->rfifo) < sizeof(rec) + rec.len) {
+		acq->dropped++;
+	} else {
+		kfifo_in(&ch34x_dev->rfifo, &rec, sizeof(rec));
+		kfifo_in(&ch34x_dev->rfifo, urb->transfer_buffer, rec.len);
+		ch34x_dev->rx_bytes += sizeof(rec) + rec.len;
+	}
 	spin_unlock_irqrestore(&ch34x_dev->read_lock, flags);
 
-	if (fifolen == 0) {
-		retval = wait_event_interruptible_timeout(
-			ch34x_dev->wait,
-			ch34x_dev->rx_flag ||
-				(ch34x_dev->interface == NULL),
-			msecs_to_jiffies(ch34x_dev->readtimeout));
-		if (retval <= 0)
-			return retval;
-	}
+	ch34x_dev->rx_flag = true;
+	wake_up_interruptible(&ch34x_dev->wait);
+out:
+	atomic_dec(&acq->pending);
+}
 
-	bytes_read = bytes_to_read > fifolen ? fifolen : bytes_to_read;
+/*
+ * Put the armed transaction on the bus unless the previous one has not
+ * completed yet. Runs in atomic context. The in urb goes first so the
+ * response always finds it waiting.
+ */
+static void ch34x_acq_fire(struct ch34x_pis *ch34x_dev)
+{
+	struct ch34x_acq *acq = &ch34x_dev->acq;
+	unsigned long flags;
 
-	obuf = (char *)kmalloc(sizeof(unsigned char) * bytes_to_read,
-			       GFP_KERNEL);
-	if (!obuf) {
-		retval = -ENOMEM;
-		goto error;
+	if (atomic_read(&acq->pending)) {
+		spin_lock_irqsave(&ch34x_dev->read_lock, flags);
+		acq->overruns++;
+		spin_unlock_irqrestore(&ch34x_dev->read_lock, flags);
+		return;
 	}
 
-	spin_lock_irqsave(&ch34x_dev->read_lock, flags);
-	retval = kfifo_out(&ch34x_dev->rfifo, obuf, bytes_read);
-	if (retval != bytes_read) {
-		spin_unlock_irqrestore(&ch34x_dev->read_lock, flags);
-		retval = -EFAULT;
-		goto error;
+	acq->seq = acq->ticks;
+	acq->stamp = ktime_get();
+	atomic_set(&acq->pending, 2);
+	if (usb_submit_urb(acq->in_urb, GFP_ATOMIC)) {
+		atomic_set(&acq->pending, 0);
+		return;
 	}
-	spin_unlock_irqrestore(&ch34x_dev->read_lock, flags);
+	if (usb_submit_urb(acq->out_urb, GFP_ATOMIC)) {
+		atomic_dec(&acq->pending);
+		usb_unlink_urb(acq->in_urb);
+	}
+}
 
-	retval = copy_to_user((char __user *)obuffer, obuf, bytes_read);
-	if (retval)
-		retval = -ENOMEM;
+static enum hrtimer_restart ch34x_acq_tick(struct hrtimer *timer)
+{
+	struct ch34x_pis *ch34x_dev =
+		container_of(timer, struct ch34x_pis, acq.timer);
+	struct ch34x_acq *acq = &ch34x_dev->acq;
 
-error:
-	if (obuf)
-		kfree(obuf);
-exit:
-	return retval == 0 ? bytes_read : retval;
+	ch34x_acq_fire(ch34x_dev);
+	/* a late timer leaves a gap in seq as well */
+	acq->ticks += hrtimer_forward_now(timer, acq->period);
+
+	return HRTIMER_RESTART;
 }
 
-static int ch34x_start_irq_task(struct ch34x_pis *ch34x_dev)
+/*
+ * Arm the transaction @cmd / @rsplen and fire it every @period_us, or on
+ * each interrupt of gpio @trigger reported by the running irq task. It
+ * holds a pm reference like the upload and feeds the rx fifo, which is
+ * allocated here for chips without a slave fifo.
+ */
+static int ch34x_start_acq(struct ch34x_pis *ch34x_dev, int trigger,
+			   u32 period_us, const u8 __user *cmd, u32 cmdlen,
+			   u32 rsplen)
 {
+	struct ch34x_acq *acq = &ch34x_dev->acq;
+	struct usb_device *udev = ch34x_dev->udev;
+	unsigned int pipe;
 	int retval = -ENODEV;
+
+	if (ch34x_dev->chiptype == CHIP_CH346C)
+		return -EOPNOTSUPP;
+	if (!cmdlen || !rsplen || cmdlen > CH34X_ACQ_PKT_MAX ||
+	    rsplen > CH34X_ACQ_PKT_MAX)
+		return -EINVAL;
+	if (trigger == CH34X_ACQ_TIMER ? period_us < CH34X_ACQ_PERIOD_MIN :
+					 trigger >= CH347_MPSI_GPIOS)
+		return -EINVAL;
+
 	mutex_lock(&ch34x_dev->io_mutex);
 	if (ch34x_dev->interface == NULL)
 		goto error;
 
-	retval = usb_autopm_get_interface(ch34x_dev->interface);
-	if (retval)
+	retval = -EBUSY;
+	if (ch34x_stream_active(ch34x_dev))
+		goto error;
+
+	/* the interrupt urb reports the gpio edges */
+	retval = -EINPROGRESS;
+	if (trigger != CH34X_ACQ_TIMER && !ch34x_dev->irq_enable)
+		goto error;
+
+	retval = -ENOMEM;
+	if (!acq->obuf) {
+		acq->obuf = kmalloc(CH34X_ACQ_PKT_MAX, GFP_KERNEL);
+		acq->ibuf = kmalloc(CH34X_ACQ_PKT_MAX, GFP_KERNEL);
+		acq->out_urb = usb_alloc_urb(0, GFP_KERNEL);
+		acq->in_urb = usb_alloc_urb(0, GFP_KERNEL);
+	}
+	if (!acq->obuf || !acq->ibuf || !acq->out_urb || !acq->in_urb)
 		goto error;
+	if (!kfifo_initialized(&ch34x_dev->rfifo) &&
+	    kfifo_alloc(&ch34x_dev->rfifo, CH34X_RX_FIFO_LENGTH, GFP_KERNEL))
+		goto error;
+
+	retval = -EFAULT;
+	if (copy_from_user(acq->obuf, cmd, cmdlen))
+		goto error;
+
+	pipe = usb_sndbulkpipe(udev, ch34x_dev->bulk_out_endpointAddr);
+	usb_fill_bulk_urb(acq->out_urb, udev, pipe, acq->obuf, cmdlen,
+			  ch34x_acq_out_callback, ch34x_dev);
+	pipe = usb_rcvbulkpipe(udev, ch34x_dev->bulk_in_endpointAddr);
+	usb_fill_bulk_urb(acq->in_urb, udev, pipe, acq->ibuf, rsplen,
+			  ch34x_acq_in_callback, ch34x_dev);
 
-	retval = usb_submit_urb(ch34x_dev->interrupt_in_urb, GFP_ATOMIC);
+	retval = usb_autopm_get_interface(ch34x_dev->interface);
 	if (retval)
 		goto error;
 
-	usb_autopm_put_interface(ch34x_dev->interface);
+	ch34x_reset_slave_fifo(ch34x_dev);
+	spin_lock_irq(&ch34x_dev->read_lock);
+	acq->overruns = 0;
+	acq->dropped = 0;
+	spin_unlock_irq(&ch34x_dev->read_lock);
+	acq->ticks = 0;
+	acq->trigger = trigger;
+	usb_unpoison_urb(acq->in_urb);
+	usb_unpoison_urb(acq->out_urb);
+	acq->running = true;
+	if (trigger == CH34X_ACQ_TIMER) {
+		acq->period = ns_to_ktime((u64)period_us * NSEC_PER_USEC);
+		hrtimer_start(&acq->timer, acq->period, HRTIMER_MODE_REL);
+	}
 	mutex_unlock(&ch34x_dev->io_mutex);
 
 	return 0;
@@ -1022,12 +4144,33 @@ error:
 	return usb_translate_errors(retval);
 }
 
-static int ch34x_stop_irq_task(struct ch34x_pis *ch34x_dev)
+/* stop the timer and the transaction in flight, io_mutex is held */
+static void ch34x_acq_stop(struct ch34x_pis *ch34x_dev)
 {
-	if (ch34x_dev->interface == NULL)
-		return -ENODEV;
+	struct ch34x_acq *acq = &ch34x_dev->acq;
 
-	usb_kill_urb(ch34x_dev->interrupt_in_urb);
+	if (!acq->running)
+		return;
+
+	/* the interrupt completion may still fire, poisoned urbs refuse it */
+	hrtimer_cancel(&acq->timer);
+	usb_poison_urb(acq->in_urb);
+	usb_poison_urb(acq->out_urb);
+	acq->running = false;
+
+	if (ch34x_dev->interface)
+		usb_autopm_put_interface(ch34x_dev->interface);
+}
+
+static int ch34x_stop_acq(struct ch34x_pis *ch34x_dev)
+{
+	mutex_lock(&ch34x_dev->io_mutex);
+	if (ch34x_dev->interface == NULL) {
+		mutex_unlock(&ch34x_dev->io_mutex);
+		return -ENODEV;
+	}
+	ch34x_acq_stop(ch34x_dev);
+	mutex_unlock(&ch34x_dev->io_mutex);
 
 	return 0;
 }
@@ -1035,6 +4178,7 @@ static int ch34x_stop_irq_task(struct ch34x_pis *ch34x_dev)
 static int ch34x_fops_open(struct inode *inode, struct file *file)
 {
 	struct ch34x_pis *ch34x_dev;
+	struct ch34x_file *cfile;
 	struct usb_interface *interface;
 	int retval = 0;
 	unsigned int subminor;
@@ -1057,17 +4201,31 @@ static int ch34x_fops_open(struct inode *inode, struct file *file)
 		goto exit;
 	}
 
+	cfile = kzalloc(sizeof(struct ch34x_file), GFP_KERNEL);
+	if (!cfile) {
+		retval = -ENOMEM;
+		goto exit;
+	}
+
 	retval = usb_autopm_get_interface(interface);
-	if (retval)
+	if (retval) {
+		kfree(cfile);
 		goto exit;
+	}
 
 	/* increment our usage count for the device */
 	kref_get(&ch34x_dev->kref);
 
-	file->private_data = ch34x_dev;
+	cfile->ch34x_dev = ch34x_dev;
+	mutex_init(&cfile->ring_mutex);
+	cfile->readtimeout = DEFAULT_TIMEOUT;
+	cfile->writetimeout = DEFAULT_TIMEOUT;
+	INIT_LIST_HEAD(&cfile->sched);
+	file->private_data = cfile;
 
-	if (ch34x_dev->chiptype == CHIP_CH346C)
-		ch34x_reset_slave_fifo(ch34x_dev);
+	spin_lock(&ch34x_dev->sched_lock);
+	ch34x_dev->sessions++;
+	spin_unlock(&ch34x_dev->sched_lock);
 
 exit:
 	return retval;
@@ -1075,13 +4233,27 @@ exit:
 
 static int ch34x_fops_release(struct inode *inode, struct file *file)
 {
+	struct ch34x_file *cfile = file->private_data;
 	struct ch34x_pis *ch34x_dev;
+	bool owner;
 
-	ch34x_dev = (struct ch34x_pis *)file->private_data;
-	if (ch34x_dev == NULL)
+	if (cfile == NULL)
 		return -ENODEV;
-
-	ch34x_dev->buffered_mode = false;
+	ch34x_dev = cfile->ch34x_dev;
+	ch34x_txring_free(ch34x_dev, cfile->txring);
+
+	/* the upload or a stream ends with the session which started it */
+	spin_lock(&ch34x_dev->sched_lock);
+	ch34x_dev->sessions--;
+	owner = ch34x_dev->fifo_owner == cfile;
+	spin_unlock(&ch34x_dev->sched_lock);
+	if (owner) {
+		ch34x_stop_read_io(ch34x_dev);
+		ch34x_stop_acq(ch34x_dev);
+		ch34x_stop_mem_stream(ch34x_dev);
+		ch34x_fifo_release(cfile);
+	}
+	kfree(cfile);
 
 	mutex_lock(&ch34x_dev->io_mutex);
 
@@ -1094,6 +4266,34 @@ static int ch34x_fops_release(struct inode *inode, struct file *file)
 	return 0;
 }
 
+/* commands which talk to the device take turns between sessions */
+static bool ch34x_ioctl_sched(unsigned int ch34x_cmd)
+{
+	switch (ch34x_cmd) {
+	case CH34x_FUNCTION_SETPARA_MODE:
+	case CH34x_SET_MODE:
+	case CH34x_PIPE_DATA_READ:
+	case CH34x_PIPE_DATA_WRITE:
+	case CH34x_PIPE_WRITE_READ:
+	case CH34x_SPI_BLOCK_READ:
+	case CH34x_JTAG_SHIFT:
+	case CH34x_PIPE_READ_FRAMES:
+	case CH34x_PIPE_DEVICE_CTRL:
+	case CH34x_INIT_SLAVE:
+	case CH34x_ACQ_START:
+	case CH34x_ACQ_ARM_GPIO:
+	case CH34x_UIO_SEQUENCE:
+	case CH34x_EPP_SCRIPT:
+	case CH34x_MEM_STREAM_START:
+	case CH34x_TXRING_DOORBELL:
+	case CH34x_START_IRQ_TASK:
+	case CH34x_STOP_IRQ_TASK:
+		return true;
+	default:
+		return false;
+	}
+}
+
 #if (LINUX_VERSION_CODE < KERNEL_VERSION(2, 6, 35))
 static int ch34x_fops_ioctl(struct inode *inode, struct file *file,
 			    unsigned int ch34x_cmd,
@@ -1104,27 +4304,48 @@ static long ch34x_fops_ioctl(struct file *file, unsigned int ch34x_cmd,
 #endif
 {
 	int retval = 0;
-	char *buf;
 	int readtimeout = 0;
 	int writetimeout = 0;
 	u32 bytes_to_read;
 	u32 bytes_write;
 	u32 readstep;
 	u32 readtime;
+	u32 flags;
+	u32 bits;
+	u32 busy_poll;
+	u32 slot_size;
+	u32 slot_count;
+	u32 free_slots = 0;
+	u32 nframes;
+	u32 halts;
+	u64 gap;
+	u32 info_size;
+	struct ch34x_chip_info info;
+	u32 period_us, cmdlen, rsplen;
+	u32 nsteps;
+	u32 nops;
+	int trigger;
+	u32 overruns, dropped;
 	u32 dev_id;
 	u8 mode;
 	char *drv_version = VERSION_DESC;
+	struct ch34x_file *cfile = file->private_data;
 	struct ch34x_pis *ch34x_dev;
 	unsigned long arg1, arg2, arg3;
+	bool sched;
 
-	ch34x_dev = (struct ch34x_pis *)file->private_data;
-	if (ch34x_dev == NULL) {
+	if (cfile == NULL)
 		return -ENODEV;
-	}
+	ch34x_dev = cfile->ch34x_dev;
 
-	buf = kmalloc(2, GFP_KERNEL);
-	if (!buf)
-		return -EFAULT;
+	sched = ch34x_ioctl_sched(ch34x_cmd);
+	if (sched) {
+		retval = ch34x_sched_enter(cfile);
+		if (retval) {
+			sched = false;
+			goto exit;
+		}
+	}
 
 	switch (ch34x_cmd) {
 	case CH34x_GET_DRV_VERSION:
@@ -1133,19 +4354,25 @@ static long ch34x_fops_ioctl(struct file *file, unsigned int ch34x_cmd,
 				      strlen(VERSION_DESC));
 		break;
 	case CH34x_CHIP_VERSION:
-		retval = ch34x_control_transfer_in(VENDOR_VERSION, 0x0000,
-						   0x0000, ch34x_dev, buf,
-						   0x08);
-		if (retval < 0)
-			break;
-		if (ch34x_dev->chiptype == CHIP_CH341) {
-			ch34x_dev->chipver = *(buf + 1) << 8 | *buf;
-			retval = put_user(*buf, (u8 __user *)ch34x_arg);
-		} else if (ch34x_dev->chiptype == CHIP_CH346C) {
-			ch34x_dev->chipmode = *(buf + 4) & 0x03;
+		if (ch34x_dev->chiptype == CHIP_CH341)
+			retval = put_user((u8)ch34x_dev->chipver,
+					  (u8 __user *)ch34x_arg);
+		else if (ch34x_dev->chiptype == CHIP_CH346C)
 			retval = put_user(ch34x_dev->chipmode,
 					  (u8 __user *)ch34x_arg);
+		break;
+	case CH34x_GET_CHIP_INFO:
+		retval = get_user(info_size, (u32 __user *)ch34x_arg);
+		if (retval)
+			goto exit;
+		info = ch34x_dev->info;
+		info.size = min_t(u32, info_size, sizeof(info));
+		if (info.size < sizeof(u32)) {
+			retval = -EINVAL;
+			goto exit;
 		}
+		if (copy_to_user((void __user *)ch34x_arg, &info, info.size))
+			retval = -EFAULT;
 		break;
 	case CH34x_CHIP_TYPE:
 		retval = put_user(ch34x_dev->chiptype,
@@ -1170,18 +4397,18 @@ static long ch34x_fops_ioctl(struct file *file, unsigned int ch34x_cmd,
 		if (retval)
 			goto exit;
 		if (mode)
-			ch34x_dev->para_rmode = CH34x_PARA_CMD_R1;
+			cfile->para_rmode = CH34x_PARA_CMD_R1;
 		else
-			ch34x_dev->para_rmode = CH34x_PARA_CMD_R0;
+			cfile->para_rmode = CH34x_PARA_CMD_R0;
 		break;
 	case CH34x_FUNCTION_WRITE_MODE:
 		retval = get_user(mode, (u8 __user *)ch34x_arg);
 		if (retval)
 			goto exit;
 		if (mode)
-			ch34x_dev->para_wmode = CH34x_PARA_CMD_W1;
+			cfile->para_wmode = CH34x_PARA_CMD_W1;
 		else
-			ch34x_dev->para_wmode = CH34x_PARA_CMD_W0;
+			cfile->para_wmode = CH34x_PARA_CMD_W0;
 		break;
 	case CH34x_SET_TIMEOUT:
 		retval = get_user(readtimeout, (u32 __user *)ch34x_arg);
@@ -1191,8 +4418,8 @@ static long ch34x_fops_ioctl(struct file *file, unsigned int ch34x_cmd,
 				  ((u32 __user *)ch34x_arg + 1));
 		if (retval)
 			goto exit;
-		ch34x_dev->readtimeout = readtimeout;
-		ch34x_dev->writetimeout = writetimeout;
+		cfile->readtimeout = readtimeout;
+		cfile->writetimeout = writetimeout;
 		break;
 	case CH34x_SET_MODE:
 		retval = get_user(mode, (u8 __user *)ch34x_arg);
@@ -1202,7 +4429,161 @@ static long ch34x_fops_ioctl(struct file *file, unsigned int ch34x_cmd,
 			CH34x_CMD_MODE, (unsigned short)(mode << 8 | 0x01),
 			0x0000, ch34x_dev, NULL, 0x00);
 		break;
-	case CH34x_PIPE_DATA_READ:
+	case CH34x_PIPE_DATA_READ:
+		if (ch34x_dev->buffered_mode) {
+			retval = -EINPROGRESS;
+			goto exit;
+		}
+		retval = get_user(bytes_to_read, (u32 __user *)ch34x_arg);
+		if (retval)
+			goto exit;
+		arg1 = (unsigned long)((u32 __user *)ch34x_arg + 1);
+		retval = ch34x_data_read(ch34x_dev, (void *)arg1,
+					 bytes_to_read, cfile->busy_poll);
+		if (retval <= 0) {
+			retval = -EFAULT;
+			goto exit;
+		}
+		retval = put_user(retval, (u32 __user *)ch34x_arg);
+		break;
+	case CH34x_PIPE_DATA_WRITE:
+		retval = get_user(bytes_write, (u32 __user *)ch34x_arg);
+		if (retval)
+			goto exit;
+		arg1 = (unsigned long)((u32 __user *)ch34x_arg + 1);
+		retval = ch34x_data_write(ch34x_dev, (void *)arg1,
+					  bytes_write);
+		if (retval <= 0) {
+			retval = -EFAULT;
+			goto exit;
+		}
+		retval = put_user(retval, (u32 __user *)ch34x_arg);
+		break;
+	case CH34x_PIPE_WRITE_READ:
+		if (ch34x_dev->buffered_mode) {
+			retval = -EINPROGRESS;
+			goto exit;
+		}
+		retval = get_user(bytes_write, (u32 __user *)ch34x_arg);
+		if (retval)
+			goto exit;
+		retval = get_user(readstep, (u32 __user *)ch34x_arg + 2);
+		if (retval)
+			goto exit;
+		retval = get_user(readtime, (u32 __user *)ch34x_arg + 3);
+		if (retval)
+			goto exit;
+
+		arg1 = (unsigned long)((u32 __user *)ch34x_arg + 1);
+		arg2 = (unsigned long)((u8 __user *)ch34x_arg + 16);
+		arg3 = (unsigned long)((u8 __user *)ch34x_arg + 16 +
+				       MAX_BUFFER_LENGTH);
+		retval = ch34x_data_write_read(ch34x_dev, (void *)arg2,
+					       (void *)arg3, readstep,
+					       readtime, bytes_write,
+					       cfile->busy_poll);
+		if (retval <= 0) {
+			retval = -EFAULT;
+			goto exit;
+		}
+		retval = put_user(retval, (u32 __user *)arg1);
+		break;
+	case CH34x_SPI_BLOCK_READ:
+		if (ch34x_dev->buffered_mode) {
+			retval = -EINPROGRESS;
+			goto exit;
+		}
+		retval = get_user(bytes_to_read, (u32 __user *)ch34x_arg);
+		if (retval)
+			goto exit;
+		retval = get_user(flags, (u32 __user *)ch34x_arg + 1);
+		if (retval)
+			goto exit;
+		arg1 = (unsigned long)((u32 __user *)ch34x_arg + 2);
+		retval = ch34x_spi_block_read(ch34x_dev, (void *)arg1,
+					      bytes_to_read, flags);
+		if (retval < 0)
+			goto exit;
+		retval = put_user(retval, (u32 __user *)ch34x_arg);
+		break;
+	case CH34x_JTAG_SHIFT:
+		if (ch34x_dev->buffered_mode) {
+			retval = -EINPROGRESS;
+			goto exit;
+		}
+		retval = get_user(bits, (u32 __user *)ch34x_arg);
+		if (retval)
+			goto exit;
+		retval = get_user(flags, (u32 __user *)ch34x_arg + 1);
+		if (retval)
+			goto exit;
+		arg1 = (unsigned long)((u32 __user *)ch34x_arg + 2);
+		retval = ch34x_jtag_shift(ch34x_dev, (void *)arg1, bits,
+					  flags);
+		if (retval < 0)
+			goto exit;
+		retval = put_user(retval, (u32 __user *)ch34x_arg);
+		break;
+	case CH34x_UIO_SEQUENCE:
+		retval = get_user(nsteps, (u32 __user *)ch34x_arg);
+		if (retval)
+			goto exit;
+		arg1 = (unsigned long)((u32 __user *)ch34x_arg + 1);
+		arg2 = arg1 + (unsigned long)nsteps *
+				      sizeof(struct ch34x_uio_step);
+		retval = ch34x_uio_sequence(ch34x_dev, (void __user *)arg1,
+					    (u8 __user *)arg2, nsteps);
+		if (retval < 0)
+			goto exit;
+		retval = put_user(retval, (u32 __user *)ch34x_arg);
+		break;
+	case CH34x_EPP_SCRIPT:
+		retval = get_user(nops, (u32 __user *)ch34x_arg);
+		if (retval)
+			goto exit;
+		retval = get_user(bytes_write, (u32 __user *)ch34x_arg + 1);
+		if (retval)
+			goto exit;
+		arg1 = (unsigned long)((u32 __user *)ch34x_arg + 2);
+		arg2 = arg1 + (unsigned long)nops * sizeof(struct ch34x_epp_op);
+		arg3 = arg2 + bytes_write;
+		retval = ch34x_epp_script(ch34x_dev, (void __user *)arg1, nops,
+					  (u8 __user *)arg2, bytes_write,
+					  (u8 __user *)arg3);
+		if (retval < 0)
+			goto exit;
+		retval = put_user(retval, (u32 __user *)ch34x_arg);
+		break;
+	case CH34x_TXRING_SETUP:
+		retval = get_user(slot_size, (u32 __user *)ch34x_arg);
+		if (retval)
+			goto exit;
+		retval = get_user(slot_count, (u32 __user *)ch34x_arg + 1);
+		if (retval)
+			goto exit;
+		mutex_lock(&cfile->ring_mutex);
+		retval = ch34x_txring_setup(cfile, slot_size, slot_count);
+		mutex_unlock(&cfile->ring_mutex);
+		break;
+	case CH34x_TXRING_DOORBELL:
+		retval = get_user(slot_count, (u32 __user *)ch34x_arg);
+		if (retval)
+			goto exit;
+		retval = get_user(free_slots, (u32 __user *)ch34x_arg + 1);
+		if (retval)
+			goto exit;
+		arg1 = (unsigned long)((u32 __user *)ch34x_arg + 2);
+		retval = ch34x_txring_doorbell(cfile, slot_count, free_slots,
+					       (u32 __user *)arg1,
+					       &free_slots);
+		if (retval < 0)
+			goto exit;
+		retval = put_user(retval, (u32 __user *)ch34x_arg);
+		if (retval)
+			goto exit;
+		retval = put_user(free_slots, (u32 __user *)ch34x_arg + 1);
+		break;
+	case CH34x_PIPE_READ_FRAMES:
 		if (ch34x_dev->buffered_mode) {
 			retval = -EINPROGRESS;
 			goto exit;
@@ -1210,90 +4591,169 @@ static long ch34x_fops_ioctl(struct file *file, unsigned int ch34x_cmd,
 		retval = get_user(bytes_to_read, (u32 __user *)ch34x_arg);
 		if (retval)
 			goto exit;
-		arg1 = (unsigned long)((u32 __user *)ch34x_arg + 1);
-		retval = ch34x_data_read(ch34x_dev, (void *)arg1,
-					 bytes_to_read);
-		if (retval <= 0) {
-			retval = -EFAULT;
+		retval = get_user(flags, (u32 __user *)ch34x_arg + 1);
+		if (retval)
+			goto exit;
+		retval = get_user(nframes, (u32 __user *)ch34x_arg + 2);
+		if (retval)
+			goto exit;
+		if (nframes > CH34X_AGG_MAX_LENGTH / USB20_CMD_HEADER) {
+			retval = -EINVAL;
 			goto exit;
 		}
+		arg1 = (unsigned long)((u32 __user *)ch34x_arg + 3);
+		arg2 = (unsigned long)((u32 __user *)arg1 + nframes);
+		retval = ch34x_read_frames(ch34x_dev, (void *)arg2,
+					   bytes_to_read, flags,
+					   (u32 __user *)arg1, &nframes);
+		if (retval < 0)
+			goto exit;
 		retval = put_user(retval, (u32 __user *)ch34x_arg);
+		if (retval)
+			goto exit;
+		retval = put_user(nframes, (u32 __user *)ch34x_arg + 2);
 		break;
-	case CH34x_PIPE_DATA_WRITE:
+	case CH34x_PIPE_LANE_XFER:
 		retval = get_user(bytes_write, (u32 __user *)ch34x_arg);
 		if (retval)
 			goto exit;
-		arg1 = (unsigned long)((u32 __user *)ch34x_arg + 1);
-		retval = ch34x_data_write(ch34x_dev, (void *)arg1,
-					  bytes_write);
-		if (retval <= 0) {
-			retval = -EFAULT;
+		retval = get_user(bytes_to_read, (u32 __user *)ch34x_arg + 1);
+		if (retval)
 			goto exit;
-		}
-		retval = put_user(retval, (u32 __user *)ch34x_arg);
+		arg1 = (unsigned long)((u32 __user *)ch34x_arg + 2);
+		arg2 = (unsigned long)((u8 __user *)arg1 + CH347_PACKET_LENGTH);
+		retval = ch34x_lane_xfer(cfile, (void *)arg1, bytes_write,
+					 (void *)arg2, bytes_to_read);
+		if (retval < 0)
+			goto exit;
+		retval = put_user(retval, (u32 __user *)ch34x_arg + 1);
 		break;
-	case CH34x_PIPE_WRITE_READ:
-		if (ch34x_dev->buffered_mode) {
-			retval = -EINPROGRESS;
+	case CH34x_PIPE_DEVICE_CTRL:
+		retval = get_user(mode, (u8 __user *)ch34x_arg);
+		if (retval)
+			goto exit;
+		retval = ch34x_parallel_init(mode, ch34x_dev);
+		break;
+	case CH34x_ACQ_START:
+	case CH34x_ACQ_ARM_GPIO:
+		/* the first word is the period or the gpio index */
+		retval = get_user(period_us, (u32 __user *)ch34x_arg);
+		if (retval)
+			goto exit;
+		retval = get_user(cmdlen, (u32 __user *)ch34x_arg + 1);
+		if (retval)
+			goto exit;
+		retval = get_user(rsplen, (u32 __user *)ch34x_arg + 2);
+		if (retval)
 			goto exit;
+		trigger = CH34X_ACQ_TIMER;
+		if (ch34x_cmd == CH34x_ACQ_ARM_GPIO) {
+			if (period_us >= CH347_MPSI_GPIOS) {
+				retval = -EINVAL;
+				goto exit;
+			}
+			trigger = period_us;
 		}
-		retval = get_user(bytes_write, (u32 __user *)ch34x_arg);
+		retval = ch34x_fifo_claim(cfile);
 		if (retval)
 			goto exit;
-		retval = get_user(readstep, (u32 __user *)ch34x_arg + 2);
+		arg1 = (unsigned long)((u32 __user *)ch34x_arg + 3);
+		retval = ch34x_start_acq(ch34x_dev, trigger, period_us,
+					 (const u8 __user *)arg1, cmdlen,
+					 rsplen);
+		if (retval && !ch34x_dev->buffered_mode)
+			ch34x_fifo_release(cfile);
+		break;
+	case CH34x_ACQ_STOP:
+		if (!ch34x_fifo_owned(cfile, false)) {
+			retval = -EBUSY;
+			goto exit;
+		}
+		retval = ch34x_stop_acq(ch34x_dev);
+		if (!retval && !ch34x_dev->buffered_mode)
+			ch34x_fifo_release(cfile);
+		break;
+	case CH34x_MEM_STREAM_START:
+		retval = get_user(bytes_to_read, (u32 __user *)ch34x_arg);
 		if (retval)
 			goto exit;
-		retval = get_user(readtime, (u32 __user *)ch34x_arg + 3);
+		retval = ch34x_fifo_claim(cfile);
 		if (retval)
 			goto exit;
-
-		arg1 = (unsigned long)((u32 __user *)ch34x_arg + 1);
-		arg2 = (unsigned long)((u8 __user *)ch34x_arg + 16);
-		arg3 = (unsigned long)((u8 __user *)ch34x_arg + 16 +
-				       MAX_BUFFER_LENGTH);
-		retval = ch34x_data_write_read(ch34x_dev, (void *)arg2,
-					       (void *)arg3, readstep,
-					       readtime, bytes_write);
-		if (retval <= 0) {
-			retval = -EFAULT;
+		retval = ch34x_start_mem_stream(ch34x_dev, bytes_to_read);
+		if (retval && !ch34x_dev->buffered_mode)
+			ch34x_fifo_release(cfile);
+		break;
+	case CH34x_MEM_STREAM_STOP:
+		if (!ch34x_fifo_owned(cfile, false)) {
+			retval = -EBUSY;
 			goto exit;
 		}
-		retval = put_user(retval, (u32 __user *)arg1);
+		retval = ch34x_stop_mem_stream(ch34x_dev);
+		if (!retval && !ch34x_dev->buffered_mode)
+			ch34x_fifo_release(cfile);
 		break;
-	case CH34x_PIPE_DEVICE_CTRL:
-		retval = get_user(mode, (u8 __user *)ch34x_arg);
+	case CH34x_ACQ_STATUS:
+		spin_lock_irq(&ch34x_dev->read_lock);
+		overruns = ch34x_dev->acq.overruns;
+		dropped = ch34x_dev->acq.dropped;
+		spin_unlock_irq(&ch34x_dev->read_lock);
+		retval = put_user(overruns, (u32 __user *)ch34x_arg);
 		if (retval)
 			goto exit;
-		retval = ch34x_parallel_init(mode, ch34x_dev);
+		retval = put_user(dropped, (u32 __user *)ch34x_arg + 1);
 		break;
 	case CH34x_START_BUFFERED_UPLOAD:
+		retval = ch34x_fifo_claim(cfile);
+		if (retval)
+			goto exit;
+		/* a new stream starts with an empty fifo */
+		if (!ch34x_dev->buffered_mode)
+			ch34x_reset_slave_fifo(ch34x_dev);
 		retval = ch34x_start_read_io(ch34x_dev);
-		if (!retval)
-			ch34x_dev->buffered_mode = true;
+		if (retval && !ch34x_dev->buffered_mode)
+			ch34x_fifo_release(cfile);
 		break;
 	case CH34x_STOP_BUFFERED_UPLOAD:
+		if (!ch34x_fifo_owned(cfile, false)) {
+			retval = -EBUSY;
+			goto exit;
+		}
 		retval = ch34x_stop_read_io(ch34x_dev);
 		if (!retval)
-			ch34x_dev->buffered_mode = false;
+			ch34x_fifo_release(cfile);
 		break;
 	case CH34x_QWERY_SLAVE_FIFO:
+		if (!ch34x_fifo_owned(cfile, false)) {
+			retval = -EBUSY;
+			goto exit;
+		}
 		retval = ch34x_query_slave_fifo(ch34x_dev);
 		retval = put_user(retval, (u32 __user *)ch34x_arg);
 		break;
 	case CH34x_RESET_SLAVE_FIFO:
+		if (!ch34x_fifo_owned(cfile, false)) {
+			retval = -EBUSY;
+			goto exit;
+		}
 		ch34x_reset_slave_fifo(ch34x_dev);
 		break;
 	case CH34x_READ_SLAVE_FIFO:
-		if (!ch34x_dev->buffered_mode) {
+		if (!ch34x_rx_active(ch34x_dev)) {
 			retval = -EINPROGRESS;
 			goto exit;
 		}
+		if (!ch34x_fifo_owned(cfile, false)) {
+			retval = -EBUSY;
+			goto exit;
+		}
 		retval = get_user(bytes_to_read, (u32 __user *)ch34x_arg);
 		if (retval)
 			goto exit;
 		arg1 = (unsigned long)((u32 __user *)ch34x_arg + 1);
 		retval = ch34x_slave_fifo_read(ch34x_dev, (void *)arg1,
-					       bytes_to_read);
+					       bytes_to_read,
+					       cfile->readtimeout);
 		if (retval < 0) {
 			retval = -EFAULT;
 			goto exit;
@@ -1308,15 +4768,31 @@ static long ch34x_fops_ioctl(struct file *file, unsigned int ch34x_cmd,
 						    0x0000, 0x0000,
 						    ch34x_dev, NULL, 0x00);
 		break;
+	case CH34x_SET_BUSY_POLL:
+		retval = get_user(busy_poll, (u32 __user *)ch34x_arg);
+		if (retval)
+			goto exit;
+		if (busy_poll > CH34X_BUSY_POLL_MAX) {
+			retval = -EINVAL;
+			goto exit;
+		}
+		cfile->busy_poll = busy_poll;
+		break;
 	case CH34x_START_IRQ_TASK:
 		retval = ch34x_start_irq_task(ch34x_dev);
-		if (!retval)
-			ch34x_dev->irq_enable = true;
 		break;
 	case CH34x_STOP_IRQ_TASK:
 		retval = ch34x_stop_irq_task(ch34x_dev);
-		if (!retval)
-			ch34x_dev->irq_enable = false;
+		break;
+	case CH34x_QUERY_RX_GAP:
+		spin_lock_irq(&ch34x_dev->read_lock);
+		halts = ch34x_dev->halts;
+		gap = ch34x_dev->rx_gap;
+		spin_unlock_irq(&ch34x_dev->read_lock);
+		retval = put_user(halts, (u32 __user *)ch34x_arg);
+		if (retval)
+			goto exit;
+		retval = put_user(gap, (u64 __user *)ch34x_arg + 1);
 		break;
 	default:
 		retval = -ENOTTY;
@@ -1324,19 +4800,19 @@ static long ch34x_fops_ioctl(struct file *file, unsigned int ch34x_cmd,
 	}
 
 exit:
-	if (buf)
-		kfree(buf);
+	if (sched)
+		ch34x_sched_exit(cfile);
 	return retval;
 }
 
 static int ch34x_fops_fasync(int fd, struct file *file, int on)
 {
+	struct ch34x_file *cfile = file->private_data;
 	struct ch34x_pis *ch34x_dev;
 
-	ch34x_dev = (struct ch34x_pis *)file->private_data;
-	if (ch34x_dev == NULL) {
+	if (cfile == NULL)
 		return -ENODEV;
-	}
+	ch34x_dev = cfile->ch34x_dev;
 
 	return fasync_helper(fd, file, on, &ch34x_dev->fasync);
 }
@@ -1356,6 +4832,14 @@ static const struct file_operations ch34x_fops_driver = {
 	.read = ch34x_fops_read,
 	.write = ch34x_fops_write,
 	.flush = ch34x_flush,
+	.mmap = ch34x_fops_mmap,
+#if (LINUX_VERSION_CODE >= KERNEL_VERSION(6, 5, 0))
+	.read_iter = ch34x_fops_read_iter,
+	.splice_read = copy_splice_read,
+#elif (LINUX_VERSION_CODE >= KERNEL_VERSION(4, 9, 0))
+	.read_iter = ch34x_fops_read_iter,
+	.splice_read = generic_file_splice_read,
+#endif
 #if (LINUX_VERSION_CODE < KERNEL_VERSION(2, 6, 35))
 	.ioctl = ch34x_fops_ioctl,
 #else
@@ -1399,6 +4883,12 @@ static void ch34x_usb_complete_intr_urb(struct urb *urb)
 			      BIT(5);
 		triggered = ch34x_dev->interrupt_in_buffer[i + 3] & BIT(3);
 		if (irq_enabled && triggered) {
+			/* capture right here instead of after the signal */
+			if (ch34x_dev->acq.running &&
+			    ch34x_dev->acq.trigger == i) {
+				ch34x_acq_fire(ch34x_dev);
+				ch34x_dev->acq.ticks++;
+			}
 			kill_fasync(&ch34x_dev->fasync, SIGIO, POLL_IN);
 		}
 	}
@@ -1479,6 +4969,7 @@ static void ch34x_process_read_urb(struct ch34x_pis *ch34x_dev,
 		}
 		kfifo_in(&ch34x_dev->rfifo, urb->transfer_buffer,
 			 urb->actual_length);
+		ch34x_dev->rx_bytes += urb->actual_length;
 		spin_unlock_irqrestore(&ch34x_dev->read_lock, flags);
 	}
 	ch34x_dev->rx_flag = true;
@@ -1501,6 +4992,10 @@ static void ch34x_read_bulk_callback(struct urb *urb)
 		dev_dbg(&ch34x_dev->interface->dev,
 			"%s - non-zero urb status: %d\n", __func__,
 			status);
+		/* anything but an unlink is a glitch, rearm after clearing */
+		if (status != -ENOENT && status != -ECONNRESET &&
+		    status != -ESHUTDOWN)
+			ch34x_halt_schedule(ch34x_dev, CH34X_HALT_RX);
 		return;
 	}
 
@@ -1510,6 +5005,245 @@ static void ch34x_read_bulk_callback(struct urb *urb)
 	ch34x_submit_read_urb(ch34x_dev, rb->index, GFP_ATOMIC);
 }
 
+/*
+ * Clear the endpoints which stalled and rearm the upload, so a glitch
+ * costs a gap in the stream instead of the whole session. The gap is
+ * counted in halts and its position in the stream kept in rx_gap.
+ */
+static void ch34x_halt_work(struct work_struct *work)
+{
+	struct ch34x_pis *ch34x_dev =
+		container_of(work, struct ch34x_pis, halt_work);
+	struct usb_device *udev = ch34x_dev->udev;
+	unsigned long flags;
+	unsigned int pipe;
+	bool rearm = false;
+	int retval;
+	int i;
+
+	mutex_lock(&ch34x_dev->io_mutex);
+	if (!ch34x_dev->interface)
+		goto exit;
+
+	retval = usb_autopm_get_interface(ch34x_dev->interface);
+	if (retval)
+		goto exit;
+
+	if (test_and_clear_bit(CH34X_HALT_OUT, &ch34x_dev->halted)) {
+		if (!usb_wait_anchor_empty_timeout(&ch34x_dev->submitted,
+						   1000))
+			usb_kill_anchored_urbs(&ch34x_dev->submitted);
+		pipe = usb_sndbulkpipe(udev, ch34x_dev->bulk_out_endpointAddr);
+		retval = usb_clear_halt(udev, pipe);
+		if (retval)
+			goto error;
+	}
+
+	if (test_and_clear_bit(CH34X_HALT_IN, &ch34x_dev->halted)) {
+		pipe = usb_rcvbulkpipe(udev, ch34x_dev->bulk_in_endpointAddr);
+		retval = usb_clear_halt(udev, pipe);
+		if (retval)
+			goto error;
+	}
+
+	if (test_and_clear_bit(CH34X_HALT_RX, &ch34x_dev->halted) &&
+	    ch34x_dev->buffered_mode) {
+		for (i = 0; i < ch34x_dev->rx_buflimit; i++)
+			usb_kill_urb(ch34x_dev->read_urbs[i]);
+		retval = usb_clear_halt(udev, ch34x_dev->rx_endpoint);
+		if (retval)
+			goto error;
+		rearm = true;
+	}
+
+	spin_lock_irq(&ch34x_dev->err_lock);
+	if (ch34x_dev->errors == -EPIPE)
+		ch34x_dev->errors = 0;
+	spin_unlock_irq(&ch34x_dev->err_lock);
+
+	spin_lock_irqsave(&ch34x_dev->read_lock, flags);
+	ch34x_dev->halts++;
+	if (rearm)
+		ch34x_dev->rx_gap = ch34x_dev->rx_bytes;
+	spin_unlock_irqrestore(&ch34x_dev->read_lock, flags);
+
+	if (rearm) {
+		retval = ch34x_submit_read_urbs(ch34x_dev, GFP_KERNEL);
+		if (retval)
+			goto error;
+	}
+	dev_dbg(&ch34x_dev->interface->dev, "%s - recovered from a stall\n",
+		__func__);
+	goto out;
+
+error:
+	dev_err(&ch34x_dev->interface->dev,
+		"%s - failed to recover from a stall: %d\n", __func__,
+		retval);
+	spin_lock_irq(&ch34x_dev->err_lock);
+	ch34x_dev->errors = retval;
+	spin_unlock_irq(&ch34x_dev->err_lock);
+out:
+	usb_autopm_put_interface(ch34x_dev->interface);
+	wake_up_interruptible(&ch34x_dev->wait);
+exit:
+	mutex_unlock(&ch34x_dev->io_mutex);
+}
+
+static ssize_t rx_stats_show(struct device *dev,
+			     struct device_attribute *attr, char *buf)
+{
+	struct ch34x_pis *ch34x_dev =
+		usb_get_intfdata(to_usb_interface(dev));
+	u64 bytes, gap;
+	u32 halts, overruns, dropped;
+
+	spin_lock_irq(&ch34x_dev->read_lock);
+	bytes = ch34x_dev->rx_bytes;
+	gap = ch34x_dev->rx_gap;
+	halts = ch34x_dev->halts;
+	overruns = ch34x_dev->acq.overruns;
+	dropped = ch34x_dev->acq.dropped;
+	spin_unlock_irq(&ch34x_dev->read_lock);
+
+	return scnprintf(buf, PAGE_SIZE,
+			 "bytes %llu\nhalts %u\ngap %llu\n"
+			 "acq_overruns %u\nacq_dropped %u\n",
+			 bytes, halts, gap, overruns, dropped);
+}
+static DEVICE_ATTR_RO(rx_stats);
+
+/*
+ * Read what the chip tells about itself once, so opening the device does
+ * not cost control and bulk round trips. A chip which does not answer
+ * leaves the fields at zero, probe goes on.
+ */
+static void ch34x_read_chip_info(struct ch34x_pis *ch34x_dev, u16 intr_size)
+{
+	struct ch34x_chip_info *info = &ch34x_dev->info;
+	struct usb_device *udev = ch34x_dev->udev;
+	int actual;
+	int retval;
+	u8 *buf;
+
+	info->version = CH34X_CHIP_INFO_VERSION;
+	info->vid = ch34x_dev->ch34x_id[0];
+	info->pid = ch34x_dev->ch34x_id[1];
+	info->chiptype = ch34x_dev->chiptype;
+	info->speed = udev->speed;
+	info->ifnum =
+		ch34x_dev->interface->cur_altsetting->desc.bInterfaceNumber;
+	info->bulk_in_size = ch34x_dev->bulk_in_size;
+	info->intr_in_size = intr_size;
+	if (ch34x_dev->chiptype == CHIP_CH341)
+		info->cmd_data_max = CH34x_EPP_IO_MAX;
+	else if (info->bulk_out_size > USB20_CMD_HEADER)
+		info->cmd_data_max = info->bulk_out_size - USB20_CMD_HEADER;
+
+	buf = kzalloc(USB20_CMD_HEADER + 4, GFP_KERNEL);
+	if (!buf)
+		return;
+
+	switch (ch34x_dev->chiptype) {
+	case CHIP_CH341:
+	case CHIP_CH346C:
+		retval = ch34x_control_transfer_in(VENDOR_VERSION, 0x0000,
+						   0x0000, ch34x_dev, buf,
+						   0x08);
+		if (retval < 0)
+			break;
+		if (ch34x_dev->chiptype == CHIP_CH341)
+			ch34x_dev->chipver = buf[1] << 8 | buf[0];
+		else
+			ch34x_dev->chipmode = buf[4] & 0x03;
+		break;
+	default:
+		buf[0] = USB20_CMD_INFO_RD;
+		buf[1] = 0x01;
+		buf[2] = 0x00;
+		buf[3] = CH347_INFO_CHIP;
+		retval = usb_bulk_msg(
+			udev,
+			usb_sndbulkpipe(udev, ch34x_dev->bulk_out_endpointAddr),
+			buf, USB20_CMD_HEADER + 1, &actual,
+			ch34x_dev->writetimeout);
+		if (retval)
+			break;
+		retval = usb_bulk_msg(
+			udev,
+			usb_rcvbulkpipe(udev, ch34x_dev->bulk_in_endpointAddr),
+			buf, USB20_CMD_HEADER + 4, &actual,
+			ch34x_dev->readtimeout);
+		if (!retval && actual == USB20_CMD_HEADER + 4)
+			info->fwver = buf[USB20_CMD_HEADER + 1] << 8 |
+				      buf[USB20_CMD_HEADER];
+		break;
+	}
+	if (retval < 0)
+		dev_warn(&ch34x_dev->interface->dev,
+			 "%s - chip info not available: %d\n", __func__,
+			 retval);
+
+	info->chipver = ch34x_dev->chipver;
+	info->chipmode = ch34x_dev->chipmode;
+	kfree(buf);
+}
+
+static ssize_t chip_info_show(struct device *dev,
+			      struct device_attribute *attr, char *buf)
+{
+	struct ch34x_pis *ch34x_dev =
+		usb_get_intfdata(to_usb_interface(dev));
+	struct ch34x_chip_info *info = &ch34x_dev->info;
+
+	return scnprintf(buf, PAGE_SIZE,
+			 "version %u\nid %04x:%04x\ntype %u\nmode %u\n"
+			 "speed %u\ninterface %u\nchip_version 0x%04x\n"
+			 "firmware 0x%04x\nbulk_in %u\nbulk_out %u\n"
+			 "intr_in %u\ncmd_data_max %u\n",
+			 info->version, info->vid, info->pid, info->chiptype,
+			 info->chipmode, info->speed, info->ifnum,
+			 info->chipver, info->fwver, info->bulk_in_size,
+			 info->bulk_out_size, info->intr_in_size,
+			 info->cmd_data_max);
+}
+static DEVICE_ATTR_RO(chip_info);
+
+static ssize_t tx_stats_show(struct device *dev,
+			     struct device_attribute *attr, char *buf)
+{
+	struct ch34x_pis *ch34x_dev =
+		usb_get_intfdata(to_usb_interface(dev));
+	u64 urbs, irqs, bytes, ns;
+
+	spin_lock_irq(&ch34x_dev->tx_lock);
+	urbs = ch34x_dev->tx_urbs;
+	irqs = ch34x_dev->tx_irqs;
+	bytes = ch34x_dev->tx_bytes;
+	ns = ch34x_dev->tx_callback_ns;
+	spin_unlock_irq(&ch34x_dev->tx_lock);
+
+	return scnprintf(buf, PAGE_SIZE,
+			 "urbs %llu\nirqs %llu\nbytes %llu\n"
+			 "callback_ns %llu\nirqs_per_mb %llu\n"
+			 "callback_ns_per_mb %llu\n",
+			 urbs, irqs, bytes, ns,
+			 bytes ? div64_u64(irqs << 20, bytes) : 0,
+			 bytes ? div64_u64(ns << 20, bytes) : 0);
+}
+static DEVICE_ATTR_RO(tx_stats);
+
+static struct attribute *ch34x_attrs[] = {
+	&dev_attr_tx_stats.attr,
+	&dev_attr_rx_stats.attr,
+	&dev_attr_chip_info.attr,
+	NULL,
+};
+
+static const struct attribute_group ch34x_attr_group = {
+	.attrs = ch34x_attrs,
+};
+
 /*
  * usb class driver info in order to get a minor number from the usb core
  * and to have the device registered with the driver core
@@ -1527,7 +5261,7 @@ static int ch34x_pis_probe(struct usb_interface *intf,
 	struct usb_endpoint_descriptor *endpoint;
 	struct ch34x_pis *ch34x_dev;
 	size_t buffer_size;
-	u16 epsize_intr;
+	u16 epsize_intr = 0;
 	int retval = -ENOMEM;
 	int i;
 	int num_rx_buf = CH34X_NR;
@@ -1544,6 +5278,21 @@ static int ch34x_pis_probe(struct usb_interface *intf,
 	sema_init(&ch34x_dev->limit_sem, WRITES_IN_FLIGHT);
 	spin_lock_init(&ch34x_dev->err_lock);
 	spin_lock_init(&ch34x_dev->read_lock);
+	mutex_init(&ch34x_dev->rfifo_mutex);
+	spin_lock_init(&ch34x_dev->tx_lock);
+	spin_lock_init(&ch34x_dev->lane_lock);
+	INIT_LIST_HEAD(&ch34x_dev->lane_queue);
+	INIT_WORK(&ch34x_dev->halt_work, ch34x_halt_work);
+#if (LINUX_VERSION_CODE >= KERNEL_VERSION(6, 15, 0))
+	hrtimer_setup(&ch34x_dev->acq.timer, ch34x_acq_tick, CLOCK_MONOTONIC,
+		      HRTIMER_MODE_REL);
+#else
+	hrtimer_init(&ch34x_dev->acq.timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+	ch34x_dev->acq.timer.function = ch34x_acq_tick;
+#endif
+	spin_lock_init(&ch34x_dev->sched_lock);
+	INIT_LIST_HEAD(&ch34x_dev->sched_queue);
+	init_waitqueue_head(&ch34x_dev->sched_wait);
 	init_usb_anchor(&ch34x_dev->submitted);
 	init_waitqueue_head(&ch34x_dev->wait);
 
@@ -1565,6 +5314,7 @@ static int ch34x_pis_probe(struct usb_interface *intf,
 				le16_to_cpu(endpoint->wMaxPacketSize);
 			ch34x_dev->bulk_in_endpointAddr =
 				endpoint->bEndpointAddress;
+			ch34x_dev->bulk_in_size = buffer_size;
 
 			ch34x_dev->rx_endpoint = usb_rcvbulkpipe(
 				ch34x_dev->udev,
@@ -1577,6 +5327,8 @@ static int ch34x_pis_probe(struct usb_interface *intf,
 		    (endpoint->bmAttributes & 0x03) == 0x02) {
 			ch34x_dev->bulk_out_endpointAddr =
 				endpoint->bEndpointAddress;
+			ch34x_dev->info.bulk_out_size =
+				le16_to_cpu(endpoint->wMaxPacketSize);
 		}
 
 		if ((endpoint->bEndpointAddress & USB_DIR_IN) &&
@@ -1595,15 +5347,6 @@ static int ch34x_pis_probe(struct usb_interface *intf,
 	/* save our data point in this interface device */
 	usb_set_intfdata(intf, ch34x_dev);
 
-	retval = usb_register_dev(intf, &ch34x_class);
-	if (retval) {
-		/* something prevented us from registering this driver */
-		dev_err(&intf->dev,
-			"Not able to get a minor for this device.\n");
-		usb_set_intfdata(intf, NULL);
-		goto error;
-	}
-
 	if (id->idProduct == 0x5512)
 		ch34x_dev->chiptype = CHIP_CH341;
 	else if (id->idProduct == 0x55de)
@@ -1615,6 +5358,8 @@ static int ch34x_pis_probe(struct usb_interface *intf,
 	else
 		ch34x_dev->chiptype = CHIP_CH347T;
 
+	ch34x_read_chip_info(ch34x_dev, epsize_intr);
+
 	if (ch34x_dev->interrupt_in_endpoint) {
 		ch34x_dev->interrupt_in_buffer =
 			kmalloc(epsize_intr, GFP_KERNEL);
@@ -1623,7 +5368,7 @@ static int ch34x_pis_probe(struct usb_interface *intf,
 			      usb_alloc_urb(0, GFP_KERNEL))) {
 			dev_err(&intf->dev, "failed to alloc urb");
 			retval = -ENOMEM;
-			goto error_intrurb;
+			goto error;
 		}
 		usb_fill_int_urb(
 			ch34x_dev->interrupt_in_urb, ch34x_dev->udev,
@@ -1646,14 +5391,18 @@ static int ch34x_pis_probe(struct usb_interface *intf,
 						      ch34x_dev->readsize,
 						      GFP_KERNEL,
 						      &rb->dma);
-			if (!rb->base)
-				goto error_bulkurb;
+			if (!rb->base) {
+				retval = -ENOMEM;
+				goto error;
+			}
 			rb->index = i;
 			rb->instance = ch34x_dev;
 
 			urb = usb_alloc_urb(0, GFP_KERNEL);
-			if (!urb)
-				goto error_bulkurb;
+			if (!urb) {
+				retval = -ENOMEM;
+				goto error;
+			}
 
 			urb->transfer_flags |= URB_NO_TRANSFER_DMA_MAP;
 			urb->transfer_dma = rb->dma;
@@ -1671,33 +5420,38 @@ static int ch34x_pis_probe(struct usb_interface *intf,
 		if (retval) {
 			dev_err(&ch34x_dev->interface->dev,
 				"%s - kfifo_alloc failed\n", __func__);
-			goto error_bulkurb;
+			goto error;
 		}
 	}
 
+	/* the attributes must exist before the node shows up */
+	retval = sysfs_create_group(&intf->dev.kobj, &ch34x_attr_group);
+	if (retval)
+		goto error;
+
+	retval = usb_register_dev(intf, &ch34x_class);
+	if (retval) {
+		/* something prevented us from registering this driver */
+		dev_err(&intf->dev,
+			"Not able to get a minor for this device.\n");
+		sysfs_remove_group(&intf->dev.kobj, &ch34x_attr_group);
+		goto error;
+	}
+
+	if (autosuspend_delay >= 0)
+		pm_runtime_set_autosuspend_delay(&ch34x_dev->udev->dev,
+						 autosuspend_delay);
+
 	/* let the user know what node this device is now attached to */
 	dev_info(&intf->dev, "USB device ch34x_pis #%d now attached",
 		 intf->minor);
 
 	return 0;
 
-error_bulkurb:
-	if (ch34x_dev->chiptype == CHIP_CH347F ||
-	    ch34x_dev->chiptype == CHIP_CH346C) {
-		for (i = 0; i < ch34x_dev->rx_buflimit; i++) {
-			if (ch34x_dev->read_urbs[i])
-				usb_free_urb(ch34x_dev->read_urbs[i]);
-		}
-		ch34x_read_buffers_free(ch34x_dev);
-	}
-error_intrurb:
-	if (ch34x_dev->interrupt_in_buffer)
-		kfree(ch34x_dev->interrupt_in_buffer);
-	/* give back our minor */
-	usb_deregister_dev(intf, &ch34x_class);
 error:
-	if (ch34x_dev)
-		kref_put(&ch34x_dev->kref, ch34x_delete);
+	/* ch34x_delete releases the urbs and buffers allocated so far */
+	usb_set_intfdata(intf, NULL);
+	kref_put(&ch34x_dev->kref, ch34x_delete);
 	return retval;
 }
 
@@ -1706,37 +5460,92 @@ static int ch34x_pis_suspend(struct usb_interface *intf,
 {
 	struct ch34x_pis *ch34x_dev = usb_get_intfdata(intf);
 
+	int time;
+	int i;
+
 	if (!ch34x_dev)
 		return 0;
-	stop_data_traffic(ch34x_dev);
+
+	/* do not cut off writes which are still on the bus */
+	if (PMSG_IS_AUTO(message) && !usb_anchor_empty(&ch34x_dev->submitted))
+		return -EBUSY;
+
+	time = usb_wait_anchor_empty_timeout(&ch34x_dev->submitted, 1000);
+	if (!time)
+		usb_kill_anchored_urbs(&ch34x_dev->submitted);
+
+	/* armed urbs keep their flags, resume submits them again */
+	if (ch34x_dev->acq.running) {
+		/* a gpio edge in between is lost */
+		hrtimer_cancel(&ch34x_dev->acq.timer);
+		usb_kill_urb(ch34x_dev->acq.in_urb);
+		usb_kill_urb(ch34x_dev->acq.out_urb);
+	}
+	if (ch34x_dev->mem.running) {
+		for (i = 0; i < CH34X_EPP_URBS; i++) {
+			usb_kill_urb(ch34x_dev->mem.in_urbs[i]);
+			usb_kill_urb(ch34x_dev->mem.cmd_urbs[i]);
+		}
+	}
+	if (ch34x_dev->irq_enable)
+		usb_kill_urb(ch34x_dev->interrupt_in_urb);
+	if (ch34x_dev->buffered_mode) {
+		for (i = 0; i < ch34x_dev->rx_buflimit; i++)
+			usb_kill_urb(ch34x_dev->read_urbs[i]);
+	}
 
 	return 0;
 }
 
 static int ch34x_pis_resume(struct usb_interface *intf)
 {
-	return 0;
+	struct ch34x_pis *ch34x_dev = usb_get_intfdata(intf);
+	int retval = 0;
+
+	if (!ch34x_dev)
+		return 0;
+
+	if (ch34x_dev->irq_enable)
+		retval = usb_submit_urb(ch34x_dev->interrupt_in_urb, GFP_NOIO);
+	if (!retval && ch34x_dev->buffered_mode)
+		retval = ch34x_submit_read_urbs(ch34x_dev, GFP_NOIO);
+	if (!retval && ch34x_dev->acq.running &&
+	    ch34x_dev->acq.trigger == CH34X_ACQ_TIMER)
+		hrtimer_start(&ch34x_dev->acq.timer, ch34x_dev->acq.period,
+			      HRTIMER_MODE_REL);
+	if (!retval && ch34x_dev->mem.running) {
+		/* every slot is idle, refill them as far as the fifo allows */
+		spin_lock_irq(&ch34x_dev->read_lock);
+		ch34x_dev->mem.parked = BIT(CH34X_EPP_URBS) - 1;
+		spin_unlock_irq(&ch34x_dev->read_lock);
+		ch34x_mem_refill(ch34x_dev, GFP_NOIO);
+	}
+
+	return retval;
 }
 
-static void stop_data_traffic(struct ch34x_pis *ch34x_dev)
+static void ch34x_stop_submitted(struct ch34x_pis *ch34x_dev)
 {
-	int i;
 	int time;
 
 	time = usb_wait_anchor_empty_timeout(&ch34x_dev->submitted, 1000);
 	if (!time)
 		usb_kill_anchored_urbs(&ch34x_dev->submitted);
+}
 
-	if (ch34x_dev->irq_enable) {
-		usb_kill_urb(ch34x_dev->interrupt_in_urb);
-		ch34x_dev->irq_enable = false;
-	}
+/* the acquisition, MEM, interrupt and read streams serve every session */
+static void ch34x_stop_streams(struct ch34x_pis *ch34x_dev)
+{
+	ch34x_acq_stop(ch34x_dev);
+	ch34x_mem_stop(ch34x_dev);
+	ch34x_irq_stop(ch34x_dev);
+	ch34x_rx_stop(ch34x_dev);
+}
 
-	if (ch34x_dev->buffered_mode) {
-		for (i = 0; i < ch34x_dev->rx_buflimit; i++)
-			usb_kill_urb(ch34x_dev->read_urbs[i]);
-		ch34x_dev->buffered_mode = false;
-	}
+static void stop_data_traffic(struct ch34x_pis *ch34x_dev)
+{
+	ch34x_stop_submitted(ch34x_dev);
+	ch34x_stop_streams(ch34x_dev);
 }
 
 static void ch34x_usb_free_device(struct ch34x_pis *ch34x_dev)
@@ -1749,6 +5558,7 @@ static void ch34x_usb_free_device(struct ch34x_pis *ch34x_dev)
 	mutex_unlock(&ch34x_dev->io_mutex);
 
 	stop_data_traffic(ch34x_dev);
+	cancel_work_sync(&ch34x_dev->halt_work);
 	if (ch34x_dev->interrupt_in_urb)
 		usb_free_urb(ch34x_dev->interrupt_in_urb);
 
@@ -1759,7 +5569,22 @@ static void ch34x_usb_free_device(struct ch34x_pis *ch34x_dev)
 		for (i = 0; i < ch34x_dev->rx_buflimit; i++)
 			usb_free_urb(ch34x_dev->read_urbs[i]);
 		ch34x_read_buffers_free(ch34x_dev);
+	} else {
+		kfifo_free(&ch34x_dev->rfifo);
+	}
+
+	usb_free_urb(ch34x_dev->acq.in_urb);
+	usb_free_urb(ch34x_dev->acq.out_urb);
+	kfree(ch34x_dev->acq.ibuf);
+	kfree(ch34x_dev->acq.obuf);
+	for (i = 0; i < CH34X_EPP_URBS; i++) {
+		usb_free_urb(ch34x_dev->mem.in_urbs[i]);
+		usb_free_urb(ch34x_dev->mem.cmd_urbs[i]);
+		kfree(ch34x_dev->mem.bufs[i]);
 	}
+	kfree(ch34x_dev->mem.cmd);
+
+	ch34x_tx_bufs_free(ch34x_dev);
 }
 
 static void ch34x_delete(struct kref *kref)
@@ -1767,8 +5592,8 @@ static void ch34x_delete(struct kref *kref)
 	struct ch34x_pis *ch34x_dev =
 		container_of(kref, struct ch34x_pis, kref);
 
-	usb_put_dev(ch34x_dev->udev);
 	ch34x_usb_free_device(ch34x_dev);
+	usb_put_dev(ch34x_dev->udev);
 	kfree(ch34x_dev);
 }
 
@@ -1778,6 +5603,7 @@ static void ch34x_pis_disconnect(struct usb_interface *intf)
 	int minor = intf->minor;
 
 	ch34x_dev = usb_get_intfdata(intf);
+	sysfs_remove_group(&intf->dev.kobj, &ch34x_attr_group);
 	usb_set_intfdata(intf, NULL);
 
 	/* give back our minor */
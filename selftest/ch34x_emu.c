@@ -0,0 +1,786 @@
+/*
+ * ch347/ch346 device model on raw-gadget for testing ch34x_pis
+ *
+ * Copyright (C) 2025 Nanjing Qinheng Microelectronics Co., Ltd.
+ * Web:      http://wch.cn
+ * Author:   WCH <tech@wch.cn>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * Enumerates through dummy_hcd (or any UDC) with the VID/PID and the
+ * interface number the driver binds to, and answers the vendor command
+ * protocol on the bulk endpoints:
+ *
+ * ch347f/ch347t: SPI_INIT, SPI_RD_WR (MISO loops back MOSI), SPI_BLCK_RD
+ *                (counting pattern), SPI_BLCK_WR, INFO_RD, JTAG_INIT,
+ *                JTAG_BIT_OP[_RD] and JTAG_DATA_SHIFT[_RD] (TDO echoes
+ *                TDI), GPIO_OP, and gpio interrupt status every -i msecs.
+ * ch346c:        the bulk out endpoint is a sink, the bulk in endpoint a
+ *                FIFO source of 32-bit little-endian counters paced to -r
+ *                bytes per second.
+ *
+ * V1.0 - initial version
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <signal.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/ioctl.h>
+#include <linux/usb/ch9.h>
+#include <linux/usb/raw_gadget.h>
+
+#define CH34X_VID 0x1a86
+#define CH347_PACKET_LENGTH 512
+#define CH347_INTR_LENGTH 16
+#define CH347_GPIO_CNT 8
+#define USB20_CMD_HEADER 3
+#define CH347_BLCK_RD_STEP 507 /* payload of one SPI_BLCK_RD packet */
+#define CH346_SOURCE_CHUNK 0x4000
+#define EP0_MAX_DATA 1024
+
+#define EP_BULK_IN 0x81 /* ep1in-bulk of dummy_udc */
+#define EP_BULK_OUT 0x02 /* ep2out-bulk */
+#define EP_INTR_IN 0x85 /* ep5in-int */
+
+#define VENDOR_VERSION 0x5F
+
+#define USB20_CMD_SPI_INIT 0xC0
+#define USB20_CMD_SPI_CONTROL 0xC1
+#define USB20_CMD_SPI_RD_WR 0xC2
+#define USB20_CMD_SPI_BLCK_RD 0xC3
+#define USB20_CMD_SPI_BLCK_WR 0xC4
+#define USB20_CMD_INFO_RD 0xCA
+#define USB20_CMD_GPIO_OP 0xCC
+#define USB20_CMD_JTAG_INIT 0xD0
+#define USB20_CMD_JTAG_BIT_OP 0xD1
+#define USB20_CMD_JTAG_BIT_OP_RD 0xD2
+#define USB20_CMD_JTAG_DATA_SHIFT 0xD3
+#define USB20_CMD_JTAG_DATA_SHIFT_RD 0xD4
+
+#define JTAG_TDI_H 0x10
+#define JTAG_TCK_H 0x01
+
+struct emu_chip {
+	const char *name;
+	uint16_t pid;
+	uint8_t ifnum; /* interface the driver binds to */
+	bool fifo; /* ch346c fifo model instead of the command protocol */
+};
+
+static const struct emu_chip emu_chips[] = {
+	{ "ch347t", 0x55dd, 2, false }, /* mode3, JTAG+UART */
+	{ "ch347f", 0x55de, 4, false },
+	{ "ch346c", 0x55eb, 2, true },
+};
+
+/* one response, sent as a transfer of its own like the chip does */
+struct emu_rsp {
+	struct emu_rsp *next;
+	uint32_t len;
+	uint8_t data[];
+};
+
+static const struct emu_chip *chip;
+static int raw_fd;
+static int ep_in = -1, ep_out = -1, ep_intr = -1;
+static unsigned int intr_ms = 10;
+static uint64_t fifo_rate; /* bytes per second, 0: unpaced */
+static uint8_t fifo_mode = 0x00; /* returned by VENDOR_VERSION */
+static volatile sig_atomic_t stop;
+static bool verbose;
+
+static pthread_mutex_t rsp_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t rsp_cond = PTHREAD_COND_INITIALIZER;
+static struct emu_rsp *rsp_head, **rsp_tail = &rsp_head;
+
+static pthread_mutex_t gpio_lock = PTHREAD_MUTEX_INITIALIZER;
+static uint8_t gpio_status[CH347_GPIO_CNT]; /* bit7 output, bit6 level */
+
+static uint64_t sink_bytes, source_bytes;
+
+/* descriptors */
+static struct usb_device_descriptor dev_desc = {
+	.bLength = USB_DT_DEVICE_SIZE,
+	.bDescriptorType = USB_DT_DEVICE,
+	.bcdUSB = 0x0200,
+	.bDeviceClass = 0,
+	.bMaxPacketSize0 = 64,
+	.idVendor = CH34X_VID,
+	.bcdDevice = 0x0100,
+	.iManufacturer = 1,
+	.iProduct = 2,
+	.iSerialNumber = 3,
+	.bNumConfigurations = 1,
+};
+
+static struct usb_qualifier_descriptor qual_desc = {
+	.bLength = sizeof(struct usb_qualifier_descriptor),
+	.bDescriptorType = USB_DT_DEVICE_QUALIFIER,
+	.bcdUSB = 0x0200,
+	.bMaxPacketSize0 = 64,
+	.bNumConfigurations = 1,
+};
+
+static struct usb_endpoint_descriptor ep_bulk_in_desc = {
+	.bLength = USB_DT_ENDPOINT_SIZE,
+	.bDescriptorType = USB_DT_ENDPOINT,
+	.bEndpointAddress = EP_BULK_IN,
+	.bmAttributes = USB_ENDPOINT_XFER_BULK,
+	.wMaxPacketSize = CH347_PACKET_LENGTH,
+};
+
+static struct usb_endpoint_descriptor ep_bulk_out_desc = {
+	.bLength = USB_DT_ENDPOINT_SIZE,
+	.bDescriptorType = USB_DT_ENDPOINT,
+	.bEndpointAddress = EP_BULK_OUT,
+	.bmAttributes = USB_ENDPOINT_XFER_BULK,
+	.wMaxPacketSize = CH347_PACKET_LENGTH,
+};
+
+static struct usb_endpoint_descriptor ep_intr_in_desc = {
+	.bLength = USB_DT_ENDPOINT_SIZE,
+	.bDescriptorType = USB_DT_ENDPOINT,
+	.bEndpointAddress = EP_INTR_IN,
+	.bmAttributes = USB_ENDPOINT_XFER_INT,
+	.wMaxPacketSize = CH347_INTR_LENGTH,
+	.bInterval = 4, /* 1ms at high speed */
+};
+
+static void die(const char *what)
+{
+	perror(what);
+	exit(EXIT_FAILURE);
+}
+
+/*
+ * Interfaces in front of the one of the driver stand for the uarts of
+ * the chip, they carry no endpoints here.
+ */
+static int build_config(uint8_t *buf, int size)
+{
+	struct usb_config_descriptor *config = (void *)buf;
+	struct usb_interface_descriptor *intf;
+	int len = USB_DT_CONFIG_SIZE;
+	int i;
+
+	memset(buf, 0, size);
+	config->bLength = USB_DT_CONFIG_SIZE;
+	config->bDescriptorType = USB_DT_CONFIG;
+	config->bNumInterfaces = chip->ifnum + 1;
+	config->bConfigurationValue = 1;
+	config->bmAttributes = USB_CONFIG_ATT_ONE;
+	config->bMaxPower = 50;
+
+	for (i = 0; i <= chip->ifnum; i++) {
+		intf = (void *)(buf + len);
+		intf->bLength = USB_DT_INTERFACE_SIZE;
+		intf->bDescriptorType = USB_DT_INTERFACE;
+		intf->bInterfaceNumber = i;
+		intf->bInterfaceClass = USB_CLASS_VENDOR_SPEC;
+		len += USB_DT_INTERFACE_SIZE;
+		if (i != chip->ifnum)
+			continue;
+		intf->bNumEndpoints = chip->fifo ? 2 : 3;
+		memcpy(buf + len, &ep_bulk_in_desc, USB_DT_ENDPOINT_SIZE);
+		len += USB_DT_ENDPOINT_SIZE;
+		memcpy(buf + len, &ep_bulk_out_desc, USB_DT_ENDPOINT_SIZE);
+		len += USB_DT_ENDPOINT_SIZE;
+		if (!chip->fifo) {
+			memcpy(buf + len, &ep_intr_in_desc,
+			       USB_DT_ENDPOINT_SIZE);
+			len += USB_DT_ENDPOINT_SIZE;
+		}
+	}
+	config->wTotalLength = len;
+
+	return len;
+}
+
+static int build_string(uint8_t *buf, int index)
+{
+	const char *str;
+	int i;
+
+	if (index == 0) {
+		buf[0] = 4;
+		buf[1] = USB_DT_STRING;
+		buf[2] = 0x09; /* en-US */
+		buf[3] = 0x04;
+		return 4;
+	}
+	if (index == 1)
+		str = "wch.cn";
+	else if (index == 2)
+		str = chip->name;
+	else
+		str = "0123456789";
+
+	for (i = 0; str[i]; i++) {
+		buf[2 + i * 2] = str[i];
+		buf[3 + i * 2] = 0;
+	}
+	buf[0] = 2 + i * 2;
+	buf[1] = USB_DT_STRING;
+
+	return buf[0];
+}
+
+/* responses */
+static void rsp_queue(uint8_t cmd, const uint8_t *data, uint32_t len)
+{
+	struct emu_rsp *rsp;
+
+	rsp = malloc(sizeof(*rsp) + USB20_CMD_HEADER + len);
+	if (!rsp)
+		die("malloc");
+	rsp->next = NULL;
+	rsp->len = USB20_CMD_HEADER + len;
+	rsp->data[0] = cmd;
+	rsp->data[1] = (uint8_t)(len >> 0);
+	rsp->data[2] = (uint8_t)(len >> 8);
+	if (len)
+		memcpy(rsp->data + USB20_CMD_HEADER, data, len);
+
+	pthread_mutex_lock(&rsp_lock);
+	*rsp_tail = rsp;
+	rsp_tail = &rsp->next;
+	pthread_cond_signal(&rsp_cond);
+	pthread_mutex_unlock(&rsp_lock);
+}
+
+static void emu_gpio_op(const uint8_t *cfg, uint32_t len)
+{
+	uint8_t status[CH347_GPIO_CNT];
+	int i;
+
+	pthread_mutex_lock(&gpio_lock);
+	for (i = 0; i < CH347_GPIO_CNT && i < (int)len; i++) {
+		if (!(cfg[i] & 0x80))
+			continue;
+		/* bit6 sets the direction from bit5, bit4 the level from bit3 */
+		if (cfg[i] & 0x40)
+			gpio_status[i] = (gpio_status[i] & ~0x80) |
+					 ((cfg[i] & 0x20) << 2);
+		if (cfg[i] & 0x10)
+			gpio_status[i] = (gpio_status[i] & ~0x40) |
+					 ((cfg[i] & 0x08) << 3);
+	}
+	memcpy(status, gpio_status, CH347_GPIO_CNT);
+	pthread_mutex_unlock(&gpio_lock);
+
+	rsp_queue(USB20_CMD_GPIO_OP, status, CH347_GPIO_CNT);
+}
+
+static void emu_spi_block_read(const uint8_t *data, uint32_t len)
+{
+	uint8_t buf[CH347_BLCK_RD_STEP];
+	uint32_t total, off, n, i;
+
+	if (len < 4)
+		return;
+	total = data[0] | data[1] << 8 | data[2] << 16 |
+		(uint32_t)data[3] << 24;
+	for (off = 0; off < total; off += n) {
+		n = total - off;
+		if (n > CH347_BLCK_RD_STEP)
+			n = CH347_BLCK_RD_STEP;
+		for (i = 0; i < n; i++)
+			buf[i] = (uint8_t)(off + i);
+		rsp_queue(USB20_CMD_SPI_BLCK_RD, buf, n);
+	}
+}
+
+/* one byte per rising TCK, TDO follows TDI */
+static void emu_jtag_bit_op_rd(const uint8_t *data, uint32_t len)
+{
+	uint8_t tdo[CH347_PACKET_LENGTH];
+	uint32_t i, n = 0;
+
+	for (i = 0; i < len && n < sizeof(tdo); i++) {
+		if (data[i] & JTAG_TCK_H)
+			tdo[n++] = (data[i] & JTAG_TDI_H) ? 0x01 : 0x00;
+	}
+	rsp_queue(USB20_CMD_JTAG_BIT_OP_RD, tdo, n);
+}
+
+static void emu_command(uint8_t cmd, const uint8_t *data, uint32_t len)
+{
+	static const uint8_t ok = 0x00;
+	uint8_t info[4] = { 0x41, 0x03, 0x00, 0x00 }; /* firmware 0x0341 */
+
+	if (verbose)
+		fprintf(stderr, "cmd %02x len %u\n", cmd, len);
+
+	switch (cmd) {
+	case USB20_CMD_SPI_INIT:
+	case USB20_CMD_SPI_BLCK_WR:
+	case USB20_CMD_JTAG_INIT:
+		rsp_queue(cmd, &ok, 1);
+		break;
+	case USB20_CMD_SPI_RD_WR:
+	case USB20_CMD_JTAG_DATA_SHIFT_RD:
+		rsp_queue(cmd, data, len);
+		break;
+	case USB20_CMD_SPI_BLCK_RD:
+		emu_spi_block_read(data, len);
+		break;
+	case USB20_CMD_INFO_RD:
+		rsp_queue(cmd, info, sizeof(info));
+		break;
+	case USB20_CMD_GPIO_OP:
+		emu_gpio_op(data, len);
+		break;
+	case USB20_CMD_JTAG_BIT_OP_RD:
+		emu_jtag_bit_op_rd(data, len);
+		break;
+	case USB20_CMD_SPI_CONTROL:
+	case USB20_CMD_JTAG_BIT_OP:
+	case USB20_CMD_JTAG_DATA_SHIFT:
+	default:
+		/* no response */
+		break;
+	}
+}
+
+/*
+ * Commands may span packets, so the out stream is parsed byte-wise.
+ * Reads are one packet long: a request spanning several packets would
+ * not complete until the host sends a short one.
+ */
+static void *emu_out_thread(void *arg)
+{
+	struct {
+		struct usb_raw_ep_io io;
+		uint8_t data[CH347_PACKET_LENGTH];
+	} pkt;
+	static uint8_t cmd[USB20_CMD_HEADER + 0x10000];
+	uint32_t got = 0, need = USB20_CMD_HEADER;
+	int retval, i;
+
+	(void)arg;
+
+	while (!stop) {
+		pkt.io.ep = ep_out;
+		pkt.io.flags = 0;
+		pkt.io.length = sizeof(pkt.data);
+		retval = ioctl(raw_fd, USB_RAW_IOCTL_EP_READ, &pkt);
+		if (retval < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno != ESHUTDOWN)
+				perror("bulk out");
+			break;
+		}
+		if (chip->fifo) {
+			sink_bytes += retval;
+			continue;
+		}
+		for (i = 0; i < retval; i++) {
+			cmd[got++] = pkt.data[i];
+			if (got == USB20_CMD_HEADER)
+				need = USB20_CMD_HEADER +
+				       (cmd[1] | cmd[2] << 8);
+			if (got < USB20_CMD_HEADER || got < need)
+				continue;
+			emu_command(cmd[0], cmd + USB20_CMD_HEADER,
+				    got - USB20_CMD_HEADER);
+			got = 0;
+			need = USB20_CMD_HEADER;
+		}
+	}
+
+	return NULL;
+}
+
+static void *emu_in_thread(void *arg)
+{
+	struct usb_raw_ep_io *io;
+	struct emu_rsp *rsp;
+	int retval;
+
+	(void)arg;
+
+	io = malloc(sizeof(*io) + USB20_CMD_HEADER + 0x10000);
+	if (!io)
+		die("malloc");
+
+	while (!stop) {
+		pthread_mutex_lock(&rsp_lock);
+		while (!rsp_head && !stop)
+			pthread_cond_wait(&rsp_cond, &rsp_lock);
+		rsp = rsp_head;
+		if (rsp) {
+			rsp_head = rsp->next;
+			if (!rsp_head)
+				rsp_tail = &rsp_head;
+		}
+		pthread_mutex_unlock(&rsp_lock);
+		if (!rsp)
+			break;
+
+		io->ep = ep_in;
+		io->flags = 0;
+		io->length = rsp->len;
+		memcpy(io->data, rsp->data, rsp->len);
+		free(rsp);
+		retval = ioctl(raw_fd, USB_RAW_IOCTL_EP_WRITE, io);
+		if (retval < 0 && errno != EINTR) {
+			if (errno != ESHUTDOWN)
+				perror("bulk in");
+			break;
+		}
+	}
+	free(io);
+
+	return NULL;
+}
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+/* ch346c fifo source, paced to fifo_rate bytes per second */
+static void *emu_source_thread(void *arg)
+{
+	struct usb_raw_ep_io *io;
+	uint64_t start = now_ns(), due;
+	uint32_t counter = 0;
+	uint32_t *words;
+	struct timespec ts;
+	int retval, i;
+
+	(void)arg;
+
+	io = malloc(sizeof(*io) + CH346_SOURCE_CHUNK);
+	if (!io)
+		die("malloc");
+	words = (uint32_t *)io->data;
+
+	while (!stop) {
+		for (i = 0; i < CH346_SOURCE_CHUNK / 4; i++)
+			words[i] = htole32(counter++);
+		io->ep = ep_in;
+		io->flags = 0;
+		io->length = CH346_SOURCE_CHUNK;
+		retval = ioctl(raw_fd, USB_RAW_IOCTL_EP_WRITE, io);
+		if (retval < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno != ESHUTDOWN)
+				perror("fifo source");
+			break;
+		}
+		source_bytes += retval;
+
+		if (!fifo_rate)
+			continue;
+		due = start + source_bytes * 1000000000ull / fifo_rate;
+		if (due > now_ns()) {
+			ts.tv_sec = due / 1000000000ull;
+			ts.tv_nsec = due % 1000000000ull;
+			clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts,
+					NULL);
+		}
+	}
+	free(io);
+
+	return NULL;
+}
+
+/*
+ * Interrupt status like the chip sends it: a 3-byte header and one byte
+ * per gpio, bit5 marks an enabled interrupt and bit3 a pending one. The
+ * emulator triggers gpio 2 every intr_ms.
+ */
+static void *emu_intr_thread(void *arg)
+{
+	struct {
+		struct usb_raw_ep_io io;
+		uint8_t data[CH347_INTR_LENGTH];
+	} pkt;
+	int retval;
+
+	(void)arg;
+
+	while (!stop && intr_ms) {
+		usleep(intr_ms * 1000);
+		memset(pkt.data, 0, sizeof(pkt.data));
+		pkt.data[0] = USB20_CMD_GPIO_OP;
+		pkt.data[1] = CH347_GPIO_CNT;
+		pkt.data[USB20_CMD_HEADER + 2] = 0x20 | 0x08;
+		pkt.io.ep = ep_intr;
+		pkt.io.flags = 0;
+		pkt.io.length = USB20_CMD_HEADER + CH347_GPIO_CNT;
+		retval = ioctl(raw_fd, USB_RAW_IOCTL_EP_WRITE, &pkt);
+		if (retval < 0 && errno != EINTR) {
+			if (errno != ESHUTDOWN)
+				perror("interrupt in");
+			break;
+		}
+	}
+
+	return NULL;
+}
+
+static void emu_start_threads(void)
+{
+	pthread_t thread;
+
+	ep_in = ioctl(raw_fd, USB_RAW_IOCTL_EP_ENABLE, &ep_bulk_in_desc);
+	ep_out = ioctl(raw_fd, USB_RAW_IOCTL_EP_ENABLE, &ep_bulk_out_desc);
+	if (ep_in < 0 || ep_out < 0)
+		die("enable bulk endpoints");
+
+	if (pthread_create(&thread, NULL, emu_out_thread, NULL))
+		die("pthread_create");
+	pthread_detach(thread);
+	if (chip->fifo) {
+		if (pthread_create(&thread, NULL, emu_source_thread, NULL))
+			die("pthread_create");
+		pthread_detach(thread);
+		return;
+	}
+
+	if (pthread_create(&thread, NULL, emu_in_thread, NULL))
+		die("pthread_create");
+	pthread_detach(thread);
+
+	ep_intr = ioctl(raw_fd, USB_RAW_IOCTL_EP_ENABLE, &ep_intr_in_desc);
+	if (ep_intr < 0)
+		die("enable interrupt endpoint");
+	if (pthread_create(&thread, NULL, emu_intr_thread, NULL))
+		die("pthread_create");
+	pthread_detach(thread);
+}
+
+/* ep0 */
+static void ep0_stall(void)
+{
+	if (ioctl(raw_fd, USB_RAW_IOCTL_EP0_STALL, 0) < 0)
+		perror("ep0 stall");
+}
+
+static bool ep0_standard(struct usb_ctrlrequest *ctrl, uint8_t *buf,
+			 int *len)
+{
+	switch (ctrl->bRequest) {
+	case USB_REQ_GET_DESCRIPTOR:
+		switch (ctrl->wValue >> 8) {
+		case USB_DT_DEVICE:
+			memcpy(buf, &dev_desc, sizeof(dev_desc));
+			*len = sizeof(dev_desc);
+			return true;
+		case USB_DT_DEVICE_QUALIFIER:
+			memcpy(buf, &qual_desc, sizeof(qual_desc));
+			*len = sizeof(qual_desc);
+			return true;
+		case USB_DT_CONFIG:
+			*len = build_config(buf, EP0_MAX_DATA);
+			return true;
+		case USB_DT_STRING:
+			*len = build_string(buf, ctrl->wValue & 0xff);
+			return true;
+		}
+		return false;
+	case USB_REQ_SET_CONFIGURATION:
+		emu_start_threads();
+		if (ioctl(raw_fd, USB_RAW_IOCTL_VBUS_DRAW, 100) < 0)
+			perror("vbus draw");
+		if (ioctl(raw_fd, USB_RAW_IOCTL_CONFIGURE, 0) < 0)
+			die("configure");
+		*len = 0;
+		return true;
+	case USB_REQ_SET_INTERFACE:
+		*len = 0;
+		return true;
+	case USB_REQ_GET_INTERFACE:
+		buf[0] = 0;
+		*len = 1;
+		return true;
+	case USB_REQ_GET_STATUS:
+		buf[0] = 0;
+		buf[1] = 0;
+		*len = 2;
+		return true;
+	}
+
+	return false;
+}
+
+static bool ep0_vendor(struct usb_ctrlrequest *ctrl, uint8_t *buf, int *len)
+{
+	if (!(ctrl->bRequestType & USB_DIR_IN)) {
+		/* mode, parallel and slave setup carry no state here */
+		*len = 0;
+		return true;
+	}
+
+	memset(buf, 0, ctrl->wLength);
+	if (ctrl->bRequest == VENDOR_VERSION && ctrl->wLength >= 5) {
+		buf[0] = 0x30;
+		buf[4] = fifo_mode;
+	}
+	*len = ctrl->wLength;
+
+	return true;
+}
+
+static void ep0_loop(void)
+{
+	struct {
+		struct usb_raw_event event;
+		uint8_t data[sizeof(struct usb_ctrlrequest)];
+	} ev;
+	struct {
+		struct usb_raw_ep_io io;
+		uint8_t data[EP0_MAX_DATA];
+	} io;
+	struct usb_ctrlrequest *ctrl;
+	bool handled;
+	int len;
+
+	while (!stop) {
+		ev.event.type = 0;
+		ev.event.length = sizeof(ev.data);
+		if (ioctl(raw_fd, USB_RAW_IOCTL_EVENT_FETCH, &ev) < 0) {
+			if (errno == EINTR)
+				continue;
+			if (stop)
+				break;
+			die("event fetch");
+		}
+		if (ev.event.type != USB_RAW_EVENT_CONTROL)
+			continue;
+
+		ctrl = (struct usb_ctrlrequest *)ev.event.data;
+		len = 0;
+		if ((ctrl->bRequestType & USB_TYPE_MASK) == USB_TYPE_STANDARD)
+			handled = ep0_standard(ctrl, io.data, &len);
+		else if ((ctrl->bRequestType & USB_TYPE_MASK) ==
+			 USB_TYPE_VENDOR)
+			handled = ep0_vendor(ctrl, io.data, &len);
+		else
+			handled = false;
+		if (!handled) {
+			ep0_stall();
+			continue;
+		}
+
+		if (len > ctrl->wLength)
+			len = ctrl->wLength;
+		io.io.ep = 0;
+		io.io.flags = 0;
+		io.io.length = (ctrl->bRequestType & USB_DIR_IN) ?
+				       len : ctrl->wLength;
+		if (ioctl(raw_fd, (ctrl->bRequestType & USB_DIR_IN) ?
+					  USB_RAW_IOCTL_EP0_WRITE :
+					  USB_RAW_IOCTL_EP0_READ,
+			  &io) < 0)
+			perror("ep0 data");
+	}
+}
+
+static void emu_stop(int sig)
+{
+	(void)sig;
+	stop = 1;
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr,
+		"usage: %s [-c ch347f|ch347t|ch346c] [-i intr_ms] [-r bytes_per_sec]\n"
+		"          [-m ch346c_mode] [-d udc_device] [-n udc_driver] [-v]\n",
+		prog);
+	exit(EXIT_FAILURE);
+}
+
+int main(int argc, char *argv[])
+{
+	const char *udc_device = "dummy_udc.0";
+	const char *udc_driver = "dummy_udc";
+	struct usb_raw_init init = {};
+	struct sigaction sa = {};
+	unsigned int i;
+	int opt;
+
+	chip = &emu_chips[1];
+	while ((opt = getopt(argc, argv, "c:i:r:m:d:n:v")) != -1) {
+		switch (opt) {
+		case 'c':
+			chip = NULL;
+			for (i = 0; i < sizeof(emu_chips) / sizeof(emu_chips[0]);
+			     i++) {
+				if (!strcmp(optarg, emu_chips[i].name))
+					chip = &emu_chips[i];
+			}
+			if (!chip)
+				usage(argv[0]);
+			break;
+		case 'i':
+			intr_ms = strtoul(optarg, NULL, 0);
+			break;
+		case 'r':
+			fifo_rate = strtoull(optarg, NULL, 0);
+			break;
+		case 'm':
+			fifo_mode = strtoul(optarg, NULL, 0) & 0x03;
+			break;
+		case 'd':
+			udc_device = optarg;
+			break;
+		case 'n':
+			udc_driver = optarg;
+			break;
+		case 'v':
+			verbose = true;
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+
+	dev_desc.idProduct = chip->pid;
+	/* no SA_RESTART, the blocking raw-gadget ioctls have to return */
+	sa.sa_handler = emu_stop;
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+
+	raw_fd = open("/dev/raw-gadget", O_RDWR);
+	if (raw_fd < 0)
+		die("open /dev/raw-gadget");
+
+	strncpy((char *)init.driver_name, udc_driver, UDC_NAME_LENGTH_MAX - 1);
+	strncpy((char *)init.device_name, udc_device, UDC_NAME_LENGTH_MAX - 1);
+	init.speed = USB_SPEED_HIGH;
+	if (ioctl(raw_fd, USB_RAW_IOCTL_INIT, &init) < 0)
+		die("raw-gadget init");
+	if (ioctl(raw_fd, USB_RAW_IOCTL_RUN, 0) < 0)
+		die("raw-gadget run");
+
+	fprintf(stderr, "%s emulated on %s, interface %u\n", chip->name,
+		udc_device, chip->ifnum);
+	ep0_loop();
+
+	if (chip->fifo)
+		fprintf(stderr, "sink %llu bytes, source %llu bytes\n",
+			(unsigned long long)sink_bytes,
+			(unsigned long long)source_bytes);
+	close(raw_fd);
+
+	return EXIT_SUCCESS;
+}
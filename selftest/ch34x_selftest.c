@@ -0,0 +1,953 @@
+/*
+ * ch34x_pis regression, throughput and latency tests
+ *
+ * Copyright (C) 2025 Nanjing Qinheng Microelectronics Co., Ltd.
+ * Web:      http://wch.cn
+ * Author:   WCH <tech@wch.cn>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * Runs against a device served by ch34x_emu and prints TAP like the
+ * kernel selftests, the exit code is 0 when all tests passed, 1 when
+ * one failed and 4 when none could run. Throughput and latency figures
+ * go to the diagnostic lines.
+ *
+ * V1.0 - initial version
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdarg.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <signal.h>
+#include <pthread.h>
+#include <time.h>
+#include <libgen.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+
+#define KSFT_PASS 0
+#define KSFT_FAIL 1
+#define KSFT_SKIP 4
+
+#define IOCTL_MAGIC 'W'
+#define CH34x_SET_TIMEOUT _IOW(IOCTL_MAGIC, 0x93, uint16_t)
+#define CH34x_SET_BUSY_POLL _IOW(IOCTL_MAGIC, 0x95, uint16_t)
+#define CH34x_PIPE_DATA_READ _IOWR(IOCTL_MAGIC, 0xb0, uint16_t)
+#define CH34x_PIPE_DATA_WRITE _IOWR(IOCTL_MAGIC, 0xb1, uint16_t)
+#define CH34x_START_BUFFERED_UPLOAD _IOW(IOCTL_MAGIC, 0xb4, uint16_t)
+#define CH34x_STOP_BUFFERED_UPLOAD _IOW(IOCTL_MAGIC, 0xb5, uint16_t)
+#define CH34x_READ_SLAVE_FIFO _IOR(IOCTL_MAGIC, 0xb8, uint16_t)
+#define CH34x_SPI_BLOCK_READ _IOWR(IOCTL_MAGIC, 0xba, uint16_t)
+#define CH34x_JTAG_SHIFT _IOWR(IOCTL_MAGIC, 0xbb, uint16_t)
+#define CH34x_TXRING_SETUP _IOW(IOCTL_MAGIC, 0xbc, uint16_t)
+#define CH34x_TXRING_DOORBELL _IOWR(IOCTL_MAGIC, 0xbd, uint16_t)
+#define CH34x_PIPE_READ_FRAMES _IOWR(IOCTL_MAGIC, 0xbe, uint16_t)
+#define CH34x_PIPE_LANE_XFER _IOWR(IOCTL_MAGIC, 0xbf, uint16_t)
+#define CH34x_START_IRQ_TASK _IOW(IOCTL_MAGIC, 0xc0, uint16_t)
+#define CH34x_STOP_IRQ_TASK _IOW(IOCTL_MAGIC, 0xc1, uint16_t)
+#define CH34x_QUERY_RX_GAP _IOR(IOCTL_MAGIC, 0xc2, uint16_t)
+#define CH34x_GET_CHIP_INFO _IOR(IOCTL_MAGIC, 0xc3, uint16_t)
+
+#define CH34x_JTAG_ENTER_DR 0x01
+#define CH34x_JTAG_EXIT_IDLE 0x04
+#define CH34x_JTAG_READ 0x08
+
+#define CH347_PACKET_LENGTH 512
+#define MAX_BUFFER_LENGTH 0x1000
+#define USB20_CMD_HEADER 3
+#define USB20_CMD_SPI_RD_WR 0xC2
+#define USB20_CMD_SPI_BLCK_WR 0xC4
+#define USB20_CMD_GPIO_OP 0xCC
+#define CH347_GPIO_CNT 8
+
+enum CHIP_TYPE {
+	CHIP_CH341 = 0,
+	CHIP_CH347T,
+	CHIP_CH347F,
+	CHIP_CH339W,
+	CHIP_CH346C,
+};
+
+struct ch34x_chip_info {
+	uint32_t size;
+	uint32_t version;
+	uint16_t vid;
+	uint16_t pid;
+	uint8_t chiptype;
+	uint8_t chipmode;
+	uint8_t speed;
+	uint8_t ifnum;
+	uint16_t chipver;
+	uint16_t fwver;
+	uint16_t bulk_in_size;
+	uint16_t bulk_out_size;
+	uint16_t intr_in_size;
+	uint16_t cmd_data_max;
+};
+
+#define SPI_LOOP_LEN 64
+#define SPI_WRITE_LEN 0x10000
+#define SPI_WRITE_STEP 32 /* more packets per transfer than the window */
+#define SPI_WRITE_WINDOW 16 /* CH347_SPI_WR_WINDOW of the library */
+#define BLOCK_READ_LEN 0x100000
+#define FRAMES_COUNT 32
+#define JTAG_BITS 0x100001 /* odd, the last bit goes the exit path */
+#define JTAG_BITS_PKT (509 * 8 + 1) /* a 512-byte shift response */
+#define LANE_ROUNDS 200
+#define SINK_LEN 0x100000
+#define SINK_ROUNDS 16
+#define TXRING_SLOTS 8
+#define FIFO_READ_LEN 0x10000
+#define FIFO_TOTAL 0x400000
+
+struct test {
+	const char *name;
+	int (*run)(void);
+	bool (*applies)(void);
+};
+
+static const char *dev_path = "/dev/ch34x_pis0";
+static struct ch34x_chip_info info;
+static int dev_fd = -1;
+static int test_no;
+static int passed, failed, skipped;
+
+static void ksft_print_msg(const char *fmt, ...)
+{
+	va_list ap;
+
+	printf("# ");
+	va_start(ap, fmt);
+	vprintf(fmt, ap);
+	va_end(ap);
+	fflush(stdout);
+}
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static double mb_per_sec(uint64_t bytes, uint64_t ns)
+{
+	return ns ? (double)bytes * 1000.0 / ns : 0;
+}
+
+static int open_dev(void)
+{
+	uint32_t timeout[2] = { 1000, 1000 };
+	int fd;
+
+	fd = open(dev_path, O_RDWR);
+	if (fd < 0)
+		return -1;
+	if (ioctl(fd, CH34x_SET_TIMEOUT, timeout) < 0) {
+		close(fd);
+		return -1;
+	}
+
+	return fd;
+}
+
+static bool is_ch347(void)
+{
+	return info.chiptype == CHIP_CH347T || info.chiptype == CHIP_CH347F;
+}
+
+static bool has_jtag(void)
+{
+	return info.chiptype == CHIP_CH347F ||
+	       (info.chiptype == CHIP_CH347T && info.pid == 0x55dd);
+}
+
+static bool is_ch346(void)
+{
+	return info.chiptype == CHIP_CH346C;
+}
+
+/* tests */
+static int test_chip_info(void)
+{
+	char path[256], buf[1024], *dev;
+	int fd, len;
+
+	memset(&info, 0, sizeof(info));
+	info.size = sizeof(info);
+	if (ioctl(dev_fd, CH34x_GET_CHIP_INFO, &info) < 0) {
+		ksft_print_msg("GET_CHIP_INFO: %s\n", strerror(errno));
+		return KSFT_FAIL;
+	}
+	ksft_print_msg("id %04x:%04x type %u mode %u interface %u fw 0x%04x bulk %u/%u\n",
+		       info.vid, info.pid, info.chiptype, info.chipmode,
+		       info.ifnum, info.fwver, info.bulk_in_size,
+		       info.bulk_out_size);
+	if (info.size != sizeof(info) || info.vid != 0x1a86 ||
+	    !info.bulk_in_size || !info.bulk_out_size)
+		return KSFT_FAIL;
+	if (is_ch347() && info.fwver != 0x0341) {
+		ksft_print_msg("firmware 0x%04x, emulator reports 0x0341\n",
+			       info.fwver);
+		return KSFT_FAIL;
+	}
+
+	dev = basename((char *)dev_path);
+	snprintf(path, sizeof(path), "/sys/class/usbmisc/%s/device/chip_info",
+		 dev);
+	fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		ksft_print_msg("%s: %s\n", path, strerror(errno));
+		return KSFT_FAIL;
+	}
+	len = read(fd, buf, sizeof(buf) - 1);
+	close(fd);
+	if (len <= 0)
+		return KSFT_FAIL;
+	buf[len] = 0;
+	snprintf(path, sizeof(path), "id %04x:%04x\n", info.vid, info.pid);
+	if (!strstr(buf, path)) {
+		ksft_print_msg("sysfs chip_info does not match the ioctl\n");
+		return KSFT_FAIL;
+	}
+
+	return KSFT_PASS;
+}
+
+static int test_spi_loopback(void)
+{
+	struct {
+		uint32_t len;
+		uint8_t data[USB20_CMD_HEADER + SPI_LOOP_LEN];
+	} io;
+	uint8_t mosi[SPI_LOOP_LEN];
+	int i;
+
+	for (i = 0; i < SPI_LOOP_LEN; i++)
+		mosi[i] = (uint8_t)(i * 7 + 1);
+	io.len = USB20_CMD_HEADER + SPI_LOOP_LEN;
+	io.data[0] = USB20_CMD_SPI_RD_WR;
+	io.data[1] = SPI_LOOP_LEN;
+	io.data[2] = 0;
+	memcpy(io.data + USB20_CMD_HEADER, mosi, SPI_LOOP_LEN);
+	if (ioctl(dev_fd, CH34x_PIPE_DATA_WRITE, &io) < 0) {
+		ksft_print_msg("PIPE_DATA_WRITE: %s\n", strerror(errno));
+		return KSFT_FAIL;
+	}
+
+	memset(&io, 0, sizeof(io));
+	io.len = USB20_CMD_HEADER + SPI_LOOP_LEN;
+	if (ioctl(dev_fd, CH34x_PIPE_DATA_READ, &io) < 0) {
+		ksft_print_msg("PIPE_DATA_READ: %s\n", strerror(errno));
+		return KSFT_FAIL;
+	}
+	if (io.len != USB20_CMD_HEADER + SPI_LOOP_LEN ||
+	    io.data[0] != USB20_CMD_SPI_RD_WR ||
+	    memcmp(io.data + USB20_CMD_HEADER, mosi, SPI_LOOP_LEN)) {
+		ksft_print_msg("MISO does not match MOSI, got %u bytes\n",
+			       io.len);
+		return KSFT_FAIL;
+	}
+
+	return KSFT_PASS;
+}
+
+static int test_busy_poll(void)
+{
+	uint32_t busy_poll = 100;
+	int retval;
+
+	if (ioctl(dev_fd, CH34x_SET_BUSY_POLL, &busy_poll) < 0) {
+		ksft_print_msg("SET_BUSY_POLL: %s\n", strerror(errno));
+		return KSFT_FAIL;
+	}
+	retval = test_spi_loopback();
+	busy_poll = 0;
+	ioctl(dev_fd, CH34x_SET_BUSY_POLL, &busy_poll);
+
+	busy_poll = 1000000;
+	if (retval == KSFT_PASS &&
+	    ioctl(dev_fd, CH34x_SET_BUSY_POLL, &busy_poll) == 0) {
+		ksft_print_msg("SET_BUSY_POLL took %u usecs\n", busy_poll);
+		return KSFT_FAIL;
+	}
+
+	return retval;
+}
+
+/*
+ * Pipelined block write as CH347SPI_Write does it: packets of
+ * SPI_WRITE_STEP bytes batched into one transfer, at most
+ * SPI_WRITE_WINDOW of them waiting for their acknowledgement.
+ */
+static int test_spi_write_step(void)
+{
+	struct {
+		uint32_t len;
+		uint8_t data[MAX_BUFFER_LENGTH];
+	} io;
+	uint32_t nbatch, sent = 0, acked = 0, wi = 0, n, i;
+	uint64_t start, ns;
+
+	nbatch = MAX_BUFFER_LENGTH / (USB20_CMD_HEADER + SPI_WRITE_STEP);
+	if (nbatch > SPI_WRITE_WINDOW)
+		nbatch = SPI_WRITE_WINDOW;
+
+	start = now_ns();
+	while (wi < SPI_WRITE_LEN || acked < sent) {
+		if (wi < SPI_WRITE_LEN &&
+		    sent - acked + nbatch <= SPI_WRITE_WINDOW) {
+			for (n = 0, i = 0; n < nbatch && wi < SPI_WRITE_LEN;
+			     n++) {
+				io.data[i++] = USB20_CMD_SPI_BLCK_WR;
+				io.data[i++] = SPI_WRITE_STEP;
+				io.data[i++] = 0;
+				memset(io.data + i, (uint8_t)n, SPI_WRITE_STEP);
+				i += SPI_WRITE_STEP;
+				wi += SPI_WRITE_STEP;
+			}
+			io.len = i;
+			if (ioctl(dev_fd, CH34x_PIPE_DATA_WRITE, &io) < 0) {
+				ksft_print_msg("PIPE_DATA_WRITE: %s\n",
+					       strerror(errno));
+				return KSFT_FAIL;
+			}
+			sent += n;
+			continue;
+		}
+
+		io.len = CH347_PACKET_LENGTH;
+		if (ioctl(dev_fd, CH34x_PIPE_DATA_READ, &io) < 0) {
+			ksft_print_msg("PIPE_DATA_READ, %u of %u acked: %s\n",
+				       acked, sent, strerror(errno));
+			return KSFT_FAIL;
+		}
+		for (i = 0; i + USB20_CMD_HEADER <= io.len; acked++) {
+			if (io.data[i] != USB20_CMD_SPI_BLCK_WR) {
+				ksft_print_msg("unexpected response 0x%02x\n",
+					       io.data[i]);
+				return KSFT_FAIL;
+			}
+			i += USB20_CMD_HEADER + (io.data[i + 1] |
+						 io.data[i + 2] << 8);
+		}
+	}
+	ns = now_ns() - start;
+	ksft_print_msg("spi write in %u byte steps %.1f MB/s\n",
+		       SPI_WRITE_STEP, mb_per_sec(SPI_WRITE_LEN, ns));
+
+	return KSFT_PASS;
+}
+
+static int test_spi_block_read(void)
+{
+	uint32_t *io;
+	uint8_t *data;
+	uint64_t start, ns;
+	int retval = KSFT_PASS;
+	uint32_t i;
+
+	io = malloc(8 + BLOCK_READ_LEN);
+	if (!io)
+		return KSFT_FAIL;
+	data = (uint8_t *)(io + 2);
+
+	io[0] = BLOCK_READ_LEN;
+	io[1] = 0;
+	start = now_ns();
+	if (ioctl(dev_fd, CH34x_SPI_BLOCK_READ, io) < 0) {
+		ksft_print_msg("SPI_BLOCK_READ: %s\n", strerror(errno));
+		retval = KSFT_FAIL;
+		goto exit;
+	}
+	ns = now_ns() - start;
+	if (io[0] != BLOCK_READ_LEN) {
+		ksft_print_msg("read %u of %u bytes\n", io[0], BLOCK_READ_LEN);
+		retval = KSFT_FAIL;
+		goto exit;
+	}
+	for (i = 0; i < BLOCK_READ_LEN; i++) {
+		if (data[i] != (uint8_t)i) {
+			ksft_print_msg("pattern broken at %u\n", i);
+			retval = KSFT_FAIL;
+			goto exit;
+		}
+	}
+	ksft_print_msg("spi block read %.1f MB/s\n",
+		       mb_per_sec(BLOCK_READ_LEN, ns));
+
+exit:
+	free(io);
+	return retval;
+}
+
+static int test_read_frames(void)
+{
+	struct {
+		uint32_t len;
+		uint32_t flags;
+		uint32_t nframes;
+		uint32_t frames[FRAMES_COUNT];
+		uint8_t data[FRAMES_COUNT * (USB20_CMD_HEADER + 1)];
+	} *rd;
+	struct {
+		uint32_t len;
+		uint8_t data[FRAMES_COUNT * (USB20_CMD_HEADER + 1)];
+	} *wr;
+	int retval = KSFT_FAIL;
+	int i;
+
+	rd = calloc(1, sizeof(*rd));
+	wr = calloc(1, sizeof(*wr));
+	if (!rd || !wr)
+		goto exit;
+
+	/* one-byte transfers, each answered by a frame of its own */
+	for (i = 0; i < FRAMES_COUNT; i++) {
+		wr->data[i * 4 + 0] = USB20_CMD_SPI_RD_WR;
+		wr->data[i * 4 + 1] = 1;
+		wr->data[i * 4 + 2] = 0;
+		wr->data[i * 4 + 3] = (uint8_t)i;
+	}
+	wr->len = sizeof(wr->data);
+	if (ioctl(dev_fd, CH34x_PIPE_DATA_WRITE, wr) < 0) {
+		ksft_print_msg("PIPE_DATA_WRITE: %s\n", strerror(errno));
+		goto exit;
+	}
+
+	rd->len = sizeof(rd->data);
+	rd->nframes = FRAMES_COUNT;
+	if (ioctl(dev_fd, CH34x_PIPE_READ_FRAMES, rd) < 0) {
+		ksft_print_msg("PIPE_READ_FRAMES: %s\n", strerror(errno));
+		goto exit;
+	}
+	if (rd->len != sizeof(rd->data) || rd->nframes != FRAMES_COUNT) {
+		ksft_print_msg("%u bytes in %u frames\n", rd->len,
+			       rd->nframes);
+		goto exit;
+	}
+	for (i = 0; i < FRAMES_COUNT; i++) {
+		if (rd->frames[i] != USB20_CMD_HEADER + 1 ||
+		    rd->data[i * 4] != USB20_CMD_SPI_RD_WR ||
+		    rd->data[i * 4 + 3] != (uint8_t)i) {
+			ksft_print_msg("frame %d is wrong\n", i);
+			goto exit;
+		}
+	}
+	retval = KSFT_PASS;
+
+exit:
+	free(rd);
+	free(wr);
+	return retval;
+}
+
+static int jtag_shift(int fd, uint32_t bits, uint8_t *tdo, uint64_t *ns)
+{
+	uint32_t *io;
+	uint8_t *data;
+	uint64_t start;
+	uint32_t i;
+	int retval;
+
+	io = malloc(8 + (bits + 7) / 8);
+	if (!io)
+		return -1;
+	data = (uint8_t *)(io + 2);
+	for (i = 0; i < (bits + 7) / 8; i++)
+		data[i] = (uint8_t)(i * 13 + 5);
+	if (bits % 8)
+		data[bits / 8] &= (1 << (bits % 8)) - 1;
+	if (tdo)
+		memcpy(tdo, data, (bits + 7) / 8);
+
+	io[0] = bits;
+	io[1] = CH34x_JTAG_ENTER_DR | CH34x_JTAG_EXIT_IDLE | CH34x_JTAG_READ;
+	start = now_ns();
+	retval = ioctl(fd, CH34x_JTAG_SHIFT, io);
+	if (ns)
+		*ns = now_ns() - start;
+	if (retval < 0) {
+		free(io);
+		return -1;
+	}
+	if (tdo) {
+		if (bits % 8)
+			data[bits / 8] &= (1 << (bits % 8)) - 1;
+		retval = memcmp(tdo, data, (bits + 7) / 8) ? -2 : 0;
+		if (io[0] != bits)
+			retval = -2;
+	}
+	free(io);
+
+	return retval;
+}
+
+static int test_jtag_shift(void)
+{
+	uint8_t *tdi;
+	uint64_t ns;
+	int retval;
+
+	tdi = malloc((JTAG_BITS + 7) / 8);
+	if (!tdi)
+		return KSFT_FAIL;
+	retval = jtag_shift(dev_fd, JTAG_BITS, tdi, &ns);
+	free(tdi);
+	if (retval == -1) {
+		ksft_print_msg("JTAG_SHIFT: %s\n", strerror(errno));
+		return KSFT_FAIL;
+	}
+	if (retval == -2) {
+		ksft_print_msg("TDO does not echo TDI\n");
+		return KSFT_FAIL;
+	}
+	ksft_print_msg("jtag shift %.1f Mbit/s\n",
+		       mb_per_sec(JTAG_BITS, ns));
+
+	return KSFT_PASS;
+}
+
+/* the response fills the packet, no short packet follows it */
+static int test_jtag_shift_packet(void)
+{
+	uint8_t tdi[(JTAG_BITS_PKT + 7) / 8];
+	int retval;
+
+	retval = jtag_shift(dev_fd, JTAG_BITS_PKT, tdi, NULL);
+	if (retval == -1) {
+		ksft_print_msg("JTAG_SHIFT: %s\n", strerror(errno));
+		return KSFT_FAIL;
+	}
+	if (retval == -2) {
+		ksft_print_msg("TDO does not echo TDI\n");
+		return KSFT_FAIL;
+	}
+
+	return KSFT_PASS;
+}
+
+static int lane_gpio(int fd, uint64_t *ns)
+{
+	struct {
+		uint32_t olen;
+		uint32_t ilen;
+		uint8_t odata[CH347_PACKET_LENGTH];
+		uint8_t idata[CH347_PACKET_LENGTH];
+	} lane;
+	uint64_t start;
+
+	memset(&lane, 0, sizeof(lane));
+	lane.olen = USB20_CMD_HEADER + CH347_GPIO_CNT;
+	lane.ilen = USB20_CMD_HEADER + CH347_GPIO_CNT;
+	lane.odata[0] = USB20_CMD_GPIO_OP;
+	lane.odata[1] = CH347_GPIO_CNT;
+	/* gpio 0 output high */
+	lane.odata[USB20_CMD_HEADER] = 0x80 | 0x40 | 0x20 | 0x10 | 0x08;
+
+	start = now_ns();
+	if (ioctl(fd, CH34x_PIPE_LANE_XFER, &lane) < 0)
+		return -1;
+	*ns = now_ns() - start;
+	if (lane.ilen != USB20_CMD_HEADER + CH347_GPIO_CNT ||
+	    lane.idata[0] != USB20_CMD_GPIO_OP ||
+	    (lane.idata[USB20_CMD_HEADER] & 0xc0) != 0xc0)
+		return -2;
+
+	return 0;
+}
+
+static int lane_rounds(int fd, int rounds, uint64_t *avg, uint64_t *max)
+{
+	uint64_t ns, sum = 0;
+	int i, retval;
+
+	*max = 0;
+	for (i = 0; i < rounds; i++) {
+		retval = lane_gpio(fd, &ns);
+		if (retval)
+			return retval;
+		sum += ns;
+		if (ns > *max)
+			*max = ns;
+	}
+	*avg = sum / rounds;
+
+	return 0;
+}
+
+static int test_gpio_latency(void)
+{
+	uint64_t avg, max;
+	int retval;
+
+	retval = lane_rounds(dev_fd, LANE_ROUNDS, &avg, &max);
+	if (retval) {
+		ksft_print_msg("PIPE_LANE_XFER: %s\n",
+			       retval == -1 ? strerror(errno) : "bad status");
+		return KSFT_FAIL;
+	}
+	ksft_print_msg("gpio latency idle avg %llu us max %llu us\n",
+		       (unsigned long long)avg / 1000,
+		       (unsigned long long)max / 1000);
+
+	return KSFT_PASS;
+}
+
+static volatile int jtag_busy;
+
+static void *jtag_thread(void *arg)
+{
+	int fd = *(int *)arg;
+	int retval = 0;
+
+	while (jtag_busy && !retval)
+		retval = jtag_shift(fd, JTAG_BITS, NULL, NULL);
+
+	return (void *)(long)retval;
+}
+
+/* the gpio commands have to slip in between the packets of the shift */
+static int test_gpio_latency_jtag(void)
+{
+	pthread_t thread;
+	uint64_t avg, max;
+	void *status;
+	int retval, fd;
+
+	fd = open_dev();
+	if (fd < 0)
+		return KSFT_FAIL;
+	jtag_busy = 1;
+	if (pthread_create(&thread, NULL, jtag_thread, &fd)) {
+		close(fd);
+		return KSFT_FAIL;
+	}
+	usleep(20000);
+	retval = lane_rounds(dev_fd, LANE_ROUNDS, &avg, &max);
+	jtag_busy = 0;
+	pthread_join(thread, &status);
+	close(fd);
+
+	if (retval) {
+		ksft_print_msg("PIPE_LANE_XFER: %s\n",
+			       retval == -1 ? strerror(errno) : "bad status");
+		return KSFT_FAIL;
+	}
+	if (status) {
+		ksft_print_msg("JTAG_SHIFT failed next to the gpio lane\n");
+		return KSFT_FAIL;
+	}
+	ksft_print_msg("gpio latency under jtag avg %llu us max %llu us\n",
+		       (unsigned long long)avg / 1000,
+		       (unsigned long long)max / 1000);
+
+	return KSFT_PASS;
+}
+
+static volatile sig_atomic_t sigio_count;
+
+static void sigio_handler(int sig)
+{
+	(void)sig;
+	sigio_count++;
+}
+
+static int test_irq_sigio(void)
+{
+	int retval = KSFT_PASS;
+	int i;
+
+	signal(SIGIO, sigio_handler);
+	fcntl(dev_fd, F_SETOWN, getpid());
+	fcntl(dev_fd, F_SETFL, fcntl(dev_fd, F_GETFL) | O_ASYNC);
+
+	sigio_count = 0;
+	if (ioctl(dev_fd, CH34x_START_IRQ_TASK) < 0) {
+		ksft_print_msg("START_IRQ_TASK: %s\n", strerror(errno));
+		retval = KSFT_FAIL;
+		goto exit;
+	}
+	for (i = 0; i < 100 && sigio_count < 3; i++)
+		usleep(10000);
+	if (ioctl(dev_fd, CH34x_STOP_IRQ_TASK) < 0) {
+		ksft_print_msg("STOP_IRQ_TASK: %s\n", strerror(errno));
+		retval = KSFT_FAIL;
+	}
+	if (sigio_count < 3) {
+		ksft_print_msg("%d SIGIO in one second\n", (int)sigio_count);
+		retval = KSFT_FAIL;
+	}
+
+exit:
+	fcntl(dev_fd, F_SETFL, fcntl(dev_fd, F_GETFL) & ~O_ASYNC);
+	signal(SIGIO, SIG_DFL);
+	return retval;
+}
+
+static int test_fifo_sink(void)
+{
+	uint32_t *io;
+	uint64_t start, ns;
+	int retval = KSFT_PASS;
+	int i;
+
+	io = calloc(1, 4 + SINK_LEN);
+	if (!io)
+		return KSFT_FAIL;
+	start = now_ns();
+	for (i = 0; i < SINK_ROUNDS; i++) {
+		io[0] = SINK_LEN;
+		if (ioctl(dev_fd, CH34x_PIPE_DATA_WRITE, io) < 0 ||
+		    io[0] != SINK_LEN) {
+			ksft_print_msg("PIPE_DATA_WRITE: %s\n",
+				       strerror(errno));
+			retval = KSFT_FAIL;
+			break;
+		}
+	}
+	ns = now_ns() - start;
+	if (retval == KSFT_PASS)
+		ksft_print_msg("fifo sink %.1f MB/s\n",
+			       mb_per_sec((uint64_t)SINK_LEN * SINK_ROUNDS,
+					  ns));
+	free(io);
+
+	return retval;
+}
+
+static int test_txring(void)
+{
+	uint32_t setup[2] = { SINK_LEN / TXRING_SLOTS, TXRING_SLOTS };
+	uint32_t bell[2 + TXRING_SLOTS];
+	uint64_t start, ns, bytes = 0;
+	size_t size = SINK_LEN;
+	int retval = KSFT_PASS;
+	void *ring;
+	int i, j;
+
+	if (ioctl(dev_fd, CH34x_TXRING_SETUP, setup) < 0) {
+		ksft_print_msg("TXRING_SETUP: %s\n", strerror(errno));
+		return KSFT_FAIL;
+	}
+	ring = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, dev_fd, 0);
+	if (ring == MAP_FAILED) {
+		ksft_print_msg("mmap: %s\n", strerror(errno));
+		retval = KSFT_FAIL;
+		goto exit;
+	}
+	memset(ring, 0x5a, size);
+
+	start = now_ns();
+	for (i = 0; i < SINK_ROUNDS * TXRING_SLOTS;) {
+		bell[0] = TXRING_SLOTS;
+		bell[1] = 1;
+		for (j = 0; j < TXRING_SLOTS; j++)
+			bell[2 + j] = setup[0];
+		if (ioctl(dev_fd, CH34x_TXRING_DOORBELL, bell) < 0) {
+			ksft_print_msg("TXRING_DOORBELL: %s\n",
+				       strerror(errno));
+			retval = KSFT_FAIL;
+			break;
+		}
+		i += bell[0];
+		bytes += (uint64_t)bell[0] * setup[0];
+	}
+	/* wait for all slots to come back */
+	bell[0] = 0;
+	bell[1] = TXRING_SLOTS;
+	ioctl(dev_fd, CH34x_TXRING_DOORBELL, bell);
+	ns = now_ns() - start;
+	if (retval == KSFT_PASS)
+		ksft_print_msg("txring sink %.1f MB/s\n",
+			       mb_per_sec(bytes, ns));
+	munmap(ring, size);
+
+exit:
+	setup[1] = 0;
+	ioctl(dev_fd, CH34x_TXRING_SETUP, setup);
+	return retval;
+}
+
+/* the source counts in 32-bit words, a lost or doubled byte shows */
+static int check_counter(const uint8_t *data, size_t len, uint32_t *next,
+			 bool *first)
+{
+	uint32_t word;
+	size_t i;
+
+	for (i = 0; i + 4 <= len; i += 4) {
+		word = data[i] | data[i + 1] << 8 | data[i + 2] << 16 |
+		       (uint32_t)data[i + 3] << 24;
+		if (!*first && word != *next) {
+			ksft_print_msg("counter 0x%08x, expected 0x%08x\n",
+				       word, *next);
+			return -1;
+		}
+		*first = false;
+		*next = word + 1;
+	}
+
+	return 0;
+}
+
+static int test_fifo_source(void)
+{
+	struct {
+		uint32_t halts;
+		uint64_t gap;
+	} __attribute__((packed)) gap;
+	uint32_t *io;
+	uint8_t *data;
+	uint32_t next = 0;
+	uint64_t start, ns, total = 0;
+	size_t carry = 0;
+	bool first = true;
+	int retval = KSFT_PASS;
+	struct iovec iov[2];
+	ssize_t len;
+
+	io = malloc(4 + FIFO_READ_LEN);
+	data = malloc(FIFO_READ_LEN + 4);
+	if (!io || !data) {
+		retval = KSFT_FAIL;
+		goto exit;
+	}
+
+	if (ioctl(dev_fd, CH34x_START_BUFFERED_UPLOAD) < 0) {
+		ksft_print_msg("START_BUFFERED_UPLOAD: %s\n", strerror(errno));
+		retval = KSFT_FAIL;
+		goto exit;
+	}
+
+	start = now_ns();
+	while (total < FIFO_TOTAL) {
+		/* alternate the ioctl and readv so both paths are covered */
+		if ((total / FIFO_READ_LEN) & 1) {
+			iov[0].iov_base = data + carry;
+			iov[0].iov_len = FIFO_READ_LEN / 2;
+			iov[1].iov_base = data + carry + FIFO_READ_LEN / 2;
+			iov[1].iov_len = FIFO_READ_LEN / 2;
+			len = readv(dev_fd, iov, 2);
+		} else {
+			io[0] = FIFO_READ_LEN;
+			len = ioctl(dev_fd, CH34x_READ_SLAVE_FIFO, io);
+			if (len == 0) {
+				len = io[0];
+				memcpy(data + carry, io + 1, len);
+			}
+		}
+		if (len < 0) {
+			ksft_print_msg("fifo read: %s\n", strerror(errno));
+			retval = KSFT_FAIL;
+			break;
+		}
+		if (check_counter(data, carry + len, &next, &first)) {
+			retval = KSFT_FAIL;
+			break;
+		}
+		total += len;
+		/* keep a partial word for the next round */
+		memmove(data, data + ((carry + len) & ~(size_t)3),
+			(carry + len) & 3);
+		carry = (carry + len) & 3;
+	}
+	ns = now_ns() - start;
+
+	if (ioctl(dev_fd, CH34x_QUERY_RX_GAP, &gap) == 0)
+		ksft_print_msg("rx halts %u, longest gap %llu ns\n", gap.halts,
+			       (unsigned long long)gap.gap);
+	if (ioctl(dev_fd, CH34x_STOP_BUFFERED_UPLOAD) < 0) {
+		ksft_print_msg("STOP_BUFFERED_UPLOAD: %s\n", strerror(errno));
+		retval = KSFT_FAIL;
+	}
+	if (retval == KSFT_PASS)
+		ksft_print_msg("fifo source %.1f MB/s\n",
+			       mb_per_sec(total, ns));
+
+exit:
+	free(io);
+	free(data);
+	return retval;
+}
+
+static const struct test tests[] = {
+	{ "chip_info", test_chip_info, NULL },
+	{ "spi_loopback", test_spi_loopback, is_ch347 },
+	{ "busy_poll", test_busy_poll, is_ch347 },
+	{ "spi_write_step", test_spi_write_step, is_ch347 },
+	{ "spi_block_read", test_spi_block_read, is_ch347 },
+	{ "read_frames", test_read_frames, is_ch347 },
+	{ "jtag_shift", test_jtag_shift, has_jtag },
+	{ "jtag_shift_packet", test_jtag_shift_packet, has_jtag },
+	{ "gpio_latency", test_gpio_latency, is_ch347 },
+	{ "gpio_latency_jtag", test_gpio_latency_jtag, has_jtag },
+	{ "irq_sigio", test_irq_sigio, is_ch347 },
+	{ "fifo_sink", test_fifo_sink, is_ch346 },
+	{ "txring", test_txring, is_ch346 },
+	{ "fifo_source", test_fifo_source, is_ch346 },
+};
+
+#define NR_TESTS (sizeof(tests) / sizeof(tests[0]))
+
+static void run_test(const struct test *t)
+{
+	int retval;
+
+	test_no++;
+	if (t->applies && !t->applies()) {
+		printf("ok %d %s # SKIP not supported by chip type %u\n",
+		       test_no, t->name, info.chiptype);
+		skipped++;
+		return;
+	}
+
+	retval = t->run();
+	if (retval == KSFT_PASS) {
+		printf("ok %d %s\n", test_no, t->name);
+		passed++;
+	} else {
+		printf("not ok %d %s\n", test_no, t->name);
+		failed++;
+	}
+	fflush(stdout);
+}
+
+int main(int argc, char *argv[])
+{
+	unsigned int i;
+
+	if (argc > 1)
+		dev_path = argv[1];
+
+	printf("TAP version 13\n");
+	dev_fd = open_dev();
+	if (dev_fd < 0) {
+		printf("1..0 # SKIP %s: %s\n", dev_path, strerror(errno));
+		return KSFT_SKIP;
+	}
+
+	printf("1..%zu\n", NR_TESTS);
+	for (i = 0; i < NR_TESTS; i++)
+		run_test(&tests[i]);
+	close(dev_fd);
+
+	printf("# Totals: pass:%d fail:%d skip:%d\n", passed, failed,
+	       skipped);
+	if (failed)
+		return KSFT_FAIL;
+
+	return passed ? KSFT_PASS : KSFT_SKIP;
+}
@@ -0,0 +1,90 @@
+#!/bin/sh
+# SPDX-License-Identifier: GPL-2.0
+#
+# Run ch34x_selftest against ch34x_emu on dummy_hcd for every emulated
+# chip. Needs root, the dummy_hcd and raw_gadget modules and a built
+# ../driver/ch34x_pis.ko. Exits like the kernel selftests: 0 pass,
+# 1 fail, 4 skip.
+
+KSFT_PASS=0
+KSFT_FAIL=1
+KSFT_SKIP=4
+
+cd "$(dirname "$0")" || exit $KSFT_FAIL
+
+CHIPS=${CHIPS:-"ch347f ch347t ch346c"}
+FIFO_RATE=${FIFO_RATE:-20000000}
+DRIVER=../driver/ch34x_pis.ko
+
+if [ "$(id -u)" != 0 ]; then
+	echo "SKIP: must be run as root"
+	exit $KSFT_SKIP
+fi
+if ! modprobe dummy_hcd || ! modprobe raw_gadget; then
+	echo "SKIP: dummy_hcd or raw_gadget not available"
+	exit $KSFT_SKIP
+fi
+if [ ! -f $DRIVER ]; then
+	echo "SKIP: $DRIVER not built"
+	exit $KSFT_SKIP
+fi
+if [ ! -x ./ch34x_emu ] || [ ! -x ./ch34x_selftest ]; then
+	make default || exit $KSFT_FAIL
+fi
+
+loaded=0
+if ! grep -q '^ch34x_pis ' /proc/modules; then
+	insmod $DRIVER || exit $KSFT_FAIL
+	loaded=1
+fi
+
+ret=$KSFT_SKIP
+emu=
+
+cleanup()
+{
+	[ -n "$emu" ] && kill "$emu" 2>/dev/null && wait "$emu"
+	emu=
+}
+trap 'cleanup; [ $loaded = 1 ] && rmmod ch34x_pis; exit $KSFT_FAIL' INT TERM
+
+for chip in $CHIPS; do
+	./ch34x_emu -c "$chip" -r "$FIFO_RATE" &
+	emu=$!
+
+	dev=
+	for i in $(seq 50); do
+		dev=$(ls /dev/ch34x_pis* 2>/dev/null | head -n 1)
+		[ -n "$dev" ] && break
+		sleep 0.1
+	done
+	if [ -z "$dev" ]; then
+		echo "# $chip: no device node, emulator did not enumerate"
+		ret=$KSFT_FAIL
+		cleanup
+		continue
+	fi
+
+	echo "# $chip on $dev"
+	./ch34x_selftest "$dev"
+	case $? in
+	$KSFT_PASS)
+		[ $ret = $KSFT_SKIP ] && ret=$KSFT_PASS
+		;;
+	$KSFT_SKIP)
+		;;
+	*)
+		ret=$KSFT_FAIL
+		;;
+	esac
+
+	cleanup
+	# let the disconnect finish before the next chip enumerates
+	for i in $(seq 50); do
+		ls /dev/ch34x_pis* >/dev/null 2>&1 || break
+		sleep 0.1
+	done
+done
+
+[ $loaded = 1 ] && rmmod ch34x_pis
+exit $ret